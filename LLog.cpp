@@ -1,582 +1,5032 @@
 #include "LLog.hpp"
 
 #include <cstring>
+#include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <cstdio>
 #include <ctime>
 #include <thread>
 #include <tuple>
 #include <atomic>
 #include <queue>
-#include <fstream>
+#include <deque>
+#include <streambuf>
+#include <ostream>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <unordered_map>
+#include <sstream>
+#include <istream>
+#include <iterator>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <signal.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <dirent.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define LLOG_HAS_IO_URING 1
+#endif
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#include <x86intrin.h>
+#define LLOG_HAS_TSC 1
+#endif
 
 namespace
 {
-    uint64_t timestamp_now()
+    // What the raw timestamp of a logline counts, selected by set_clock_source.
+    enum class TimestampKind : uint8_t
     {
-        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
-    }
+        SYSTEM_MICROSECONDS,
+        TSC_TICKS,
+        MONOTONIC_NANOSECONDS
+    };
 
-    void format_timestamp(std::ostream &os, uint64_t timestamp)
-    {
-        std::time_t time_t = timestamp / 1000000;
-        auto gmtime = std::gmtime(&time_t);
-        char buffer[32];
-        strftime(buffer, 32, "%Y-%m-%d %T.", gmtime);
-        char microseconds[7];
-        sprintf(microseconds, "%06llu", timestamp % 1000000);
-        os << '[' << buffer << microseconds << ']';
-    }
+    std::atomic<TimestampKind> timestamp_kind{TimestampKind::SYSTEM_MICROSECONDS};
 
-    std::thread::id this_thread_id()
+    uint64_t monotonic_raw_nanoseconds()
     {
-        static thread_local const std::thread::id id = std::this_thread::get_id();
-        return id;
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
     }
 
-    template <typename T, typename Tuple>
-    struct TupleIndex;
-
-    template <typename T, typename... Types>
-    struct TupleIndex<T, std::tuple<T, Types...>>
+    uint64_t thread_cpu_nanoseconds()
     {
-        static constexpr const std::size_t value = 0;
-    };
+        timespec ts;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
 
-    template <typename T, typename U, typename... Types>
-    struct TupleIndex<T, std::tuple<U, Types...>>
+    uint64_t realtime_nanoseconds()
     {
-        static constexpr const std::size_t value = 1 + TupleIndex<T, std::tuple<Types...>>::value;
-    };
-} // anonymous namespace;
-
-namespace llog
-{
-    typedef std::tuple<char, uint32_t, uint64_t, int32_t, int64_t, double, LLogLine::string_literal_t, char *> SupportedTypes;
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
 
-    char const *to_string(LogLevel logLevel)
+    uint64_t timestamp_now()
     {
-        switch (logLevel)
+        switch (timestamp_kind.load(std::memory_order_relaxed))
         {
-        case LogLevel::INFO:
-            return "INFO";
-        case LogLevel::WARN:
-            return "WARN";
-        case LogLevel::CRIT:
-            return "CRIT";
+#ifdef LLOG_HAS_TSC
+        case TimestampKind::TSC_TICKS:
+            return __rdtsc();
+#endif
+        case TimestampKind::MONOTONIC_NANOSECONDS:
+            return monotonic_raw_nanoseconds();
+        default:
+            return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
         }
-        return "XXXX";
     }
 
-    template <typename Arg>
-    void LLogLine::encode(Arg arg)
+    void cpu_relax()
     {
-        *reinterpret_cast<Arg *>(buffer()) = arg;
-        m_bytes_used += sizeof(Arg);
+#ifdef LLOG_HAS_TSC
+        _mm_pause();
+#endif
     }
 
-    template <typename Arg>
-    void LLogLine::encode(Arg arg, uint8_t type_id)
+    std::thread::id this_thread_id()
     {
-        resize_buffer_if_needed(sizeof(Arg) + sizeof(uint8_t));
-        encode<uint8_t>(type_id);
-        encode<Arg>(arg);
+        static thread_local const std::thread::id id = std::this_thread::get_id();
+        return id;
     }
+} // anonymous namespace;
 
-    LLogLine::LLogLine(LogLevel level, char const *file, char const *function, uint32_t line)
-        : m_bytes_used(0), m_buffer_size(sizeof(m_stack_buffer))
+namespace llog
+{
+    /*
+     * Turns raw logline timestamps into wall-clock nanoseconds on the consumer side.
+     * TSC and CLOCK_MONOTONIC_RAW drift against the wall clock, so the mapping is
+     * re-anchored against CLOCK_REALTIME about once per second of log time.
+     */
+    class TimestampConverter
     {
-        encode<int64_t>(timestamp_now());
-        encode<std::thread::id>(this_thread_id());
-        encode<string_literal_t>(string_literal_t(file));
-        encode<string_literal_t>(string_literal_t(function));
-        encode<uint32_t>(line);
-        encode<LogLevel>(level);
-    }
+    public:
+        TimestampConverter()
+            : m_kind(timestamp_kind.load(std::memory_order_relaxed)),
+              m_ns_per_tick(m_kind == TimestampKind::TSC_TICKS ? tsc_ns_per_tick.load(std::memory_order_relaxed) : 1.0),
+              m_anchor_raw(0), m_anchor_ns(0), m_next_calibration_raw(0)
+        {
+            if (m_kind != TimestampKind::SYSTEM_MICROSECONDS)
+                calibrate();
+        }
 
-    LLogLine::~LLogLine() = default;
+        uint64_t to_nanoseconds(uint64_t raw)
+        {
+            if (m_kind == TimestampKind::SYSTEM_MICROSECONDS)
+                return raw * 1000;
 
-    void LLogLine::stringify(std::ostream &os)
-    {
-        char *b = !m_heap_buffer ? m_stack_buffer : m_heap_buffer.get();
-        char const *const end = b + m_bytes_used;
-        uint64_t timestamp = *reinterpret_cast<uint64_t *>(b);
-        b += sizeof(uint64_t);
-        std::thread::id threadid = *reinterpret_cast<std::thread::id *>(b);
-        b += sizeof(std::thread::id);
-        string_literal_t file = *reinterpret_cast<string_literal_t *>(b);
-        b += sizeof(string_literal_t);
-        string_literal_t function = *reinterpret_cast<string_literal_t *>(b);
-        b += sizeof(string_literal_t);
-        uint32_t line = *reinterpret_cast<uint32_t *>(b);
-        b += sizeof(uint32_t);
-        LogLevel loglevel = *reinterpret_cast<LogLevel *>(b);
-        b += sizeof(LogLevel);
+            if (raw >= m_next_calibration_raw)
+                calibrate();
 
-        format_timestamp(os, timestamp);
+            double const elapsed = raw >= m_anchor_raw ? static_cast<double>(raw - m_anchor_raw) : -static_cast<double>(m_anchor_raw - raw);
+            return m_anchor_ns + static_cast<int64_t>(elapsed * m_ns_per_tick);
+        }
 
-        os << '[' << to_string(loglevel) << ']'
-           << '[' << threadid << ']'
-           << '[' << file.m_s << ':' << function.m_s << ':' << line << ']';
+        // The current mapping, wall-clock ns = anchor_ns + (raw - anchor_raw) * ns_per_tick.
+        void anchor(uint64_t &anchor_raw, uint64_t &anchor_ns, double &ns_per_tick) const
+        {
+            anchor_raw = m_anchor_raw;
+            anchor_ns = m_anchor_ns;
+            ns_per_tick = m_ns_per_tick;
+        }
 
-        stringify(os, b, end);
+        TimestampKind kind() const
+        {
+            return m_kind;
+        }
 
-        os << std::endl;
+        // Microseconds for the system clock, nanoseconds otherwise.
+        uint8_t fraction_digits() const
+        {
+            return m_kind == TimestampKind::SYSTEM_MICROSECONDS ? 6 : 9;
+        }
 
-        if (loglevel >= LogLevel::CRIT)
-            os.flush();
-    }
+        // Estimates TSC ticks per nanosecond once, when the TSC clock source is selected.
+        static void measure_tsc()
+        {
+            uint64_t raw0 = 0, ns0 = 0, raw1 = 0, ns1 = 0;
+            sample(TimestampKind::TSC_TICKS, raw0, ns0);
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            sample(TimestampKind::TSC_TICKS, raw1, ns1);
+            tsc_ns_per_tick.store(static_cast<double>(ns1 - ns0) / static_cast<double>(raw1 - raw0), std::memory_order_relaxed);
+        }
 
-    template <typename Arg>
-    char *decode(std::ostream &os, char *b, Arg *dummy)
-    {
-        Arg arg = *reinterpret_cast<Arg *>(b);
-        os << arg;
-        return b + sizeof(Arg);
-    }
+    private:
+        // Reads the raw clock and CLOCK_REALTIME as close together as possible, always sets both.
+        static void sample(TimestampKind kind, uint64_t &raw, uint64_t &ns)
+        {
+            uint64_t best_gap = 0;
+            for (int i = 0; i < 3; ++i)
+            {
+                uint64_t const before = read_raw(kind);
+                uint64_t const wall = realtime_nanoseconds();
+                uint64_t const after = read_raw(kind);
+                if (i == 0 || after - before < best_gap)
+                {
+                    best_gap = after - before;
+                    raw = before + (after - before) / 2;
+                    ns = wall;
+                }
+            }
+        }
 
-    template <>
-    char *decode(std::ostream &os, char *b, LLogLine::string_literal_t *dummy)
-    {
-        LLogLine::string_literal_t s = *reinterpret_cast<LLogLine::string_literal_t *>(b);
-        os << s.m_s;
-        return b + sizeof(LLogLine::string_literal_t);
-    }
+        static uint64_t read_raw(TimestampKind kind)
+        {
+#ifdef LLOG_HAS_TSC
+            if (kind == TimestampKind::TSC_TICKS)
+                return __rdtsc();
+#endif
+            return monotonic_raw_nanoseconds();
+        }
 
-    template <>
-    char *decode(std::ostream &os, char *b, char **dummy)
-    {
-        while (*b != '\0')
+        void calibrate()
         {
-            os << *b;
-            ++b;
+            uint64_t raw = 0, ns = 0;
+            sample(m_kind, raw, ns);
+            if (m_kind == TimestampKind::TSC_TICKS && m_anchor_raw != 0 && raw > m_anchor_raw && ns > m_anchor_ns)
+                m_ns_per_tick = static_cast<double>(ns - m_anchor_ns) / static_cast<double>(raw - m_anchor_raw);
+            m_anchor_raw = raw;
+            m_anchor_ns = ns;
+            m_next_calibration_raw = raw + static_cast<uint64_t>(1e9 / m_ns_per_tick);
         }
-        return ++b;
-    }
 
-    void LLogLine::stringify(std::ostream &os, char *start, char const *const end)
-    {
-        if (start == end)
-            return;
+    public:
+        static std::atomic<double> tsc_ns_per_tick;
 
-        int type_id = static_cast<int>(*start);
-        start++;
+    private:
+        TimestampKind const m_kind;
+        double m_ns_per_tick;
+        uint64_t m_anchor_raw;
+        uint64_t m_anchor_ns;
+        uint64_t m_next_calibration_raw;
+    };
 
-        switch (type_id)
-        {
-        case 0:
-            stringify(os, decode(os, start, static_cast<std::tuple_element<0, SupportedTypes>::type *>(nullptr)), end);
-            return;
-        case 1:
-            stringify(os, decode(os, start, static_cast<std::tuple_element<1, SupportedTypes>::type *>(nullptr)), end);
-            return;
-        case 2:
-            stringify(os, decode(os, start, static_cast<std::tuple_element<2, SupportedTypes>::type *>(nullptr)), end);
-            return;
-        case 3:
-            stringify(os, decode(os, start, static_cast<std::tuple_element<3, SupportedTypes>::type *>(nullptr)), end);
-            return;
-        case 4:
-            stringify(os, decode(os, start, static_cast<std::tuple_element<4, SupportedTypes>::type *>(nullptr)), end);
-            return;
-        case 5:
-            stringify(os, decode(os, start, static_cast<std::tuple_element<5, SupportedTypes>::type *>(nullptr)), end);
-            return;
-        case 6:
-            stringify(os, decode(os, start, static_cast<std::tuple_element<6, SupportedTypes>::type *>(nullptr)), end);
-            return;
-        case 7:
-            stringify(os, decode(os, start, static_cast<std::tuple_element<7, SupportedTypes>::type *>(nullptr)), end);
-            return;
-        }
-    }
+    std::atomic<double> TimestampConverter::tsc_ns_per_tick{1.0};
 
-    char *LLogLine::buffer()
+    bool invariant_tsc()
     {
-        return !m_heap_buffer ? &m_stack_buffer[m_bytes_used] : &(m_heap_buffer.get())[m_bytes_used];
+#ifdef LLOG_HAS_TSC
+        unsigned int eax, ebx, ecx, edx;
+        if (__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) && eax >= 0x80000007 &&
+            __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+            return (edx & (1u << 8)) != 0;
+#endif
+        return false;
     }
 
-    void LLogLine::resize_buffer_if_needed(size_t additional_bytes)
+    void set_clock_source(ClockSource source)
     {
-        size_t const required_size = m_bytes_used + additional_bytes;
-        if (required_size <= m_buffer_size)
-            return;
-
-        if (!m_heap_buffer)
+        if (source == ClockSource::SYSTEM)
         {
-            m_buffer_size = std::max(static_cast<size_t>(512), required_size);
-            m_heap_buffer.reset(new char[m_buffer_size]);
-            memcpy(m_heap_buffer.get(), m_stack_buffer, m_bytes_used);
-            return;
+            timestamp_kind.store(TimestampKind::SYSTEM_MICROSECONDS, std::memory_order_relaxed);
+        }
+        else if (invariant_tsc())
+        {
+            TimestampConverter::measure_tsc();
+            timestamp_kind.store(TimestampKind::TSC_TICKS, std::memory_order_relaxed);
         }
         else
         {
-            m_buffer_size = std::max(static_cast<size_t>(2 * m_buffer_size), required_size);
-            std::unique_ptr<char[]> new_heap_buffer(new char[m_buffer_size]);
-            memcpy(new_heap_buffer.get(), m_heap_buffer.get(), m_bytes_used);
-            m_heap_buffer.swap(new_heap_buffer);
+            timestamp_kind.store(TimestampKind::MONOTONIC_NANOSECONDS, std::memory_order_relaxed);
         }
     }
 
-    void LLogLine::encode(char const *arg)
+    // Encoded fields sit at any offset, they are read back with memcpy as encode() wrote them.
+    template <typename T>
+    T load(char const *b)
     {
-        if (arg != nullptr)
-            encode_c_string(arg, strlen(arg));
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+        memcpy(&value, b, sizeof(T));
+        return *reinterpret_cast<T *>(&value);
     }
 
-    void LLogLine::encode(char *arg)
+    template <typename Arg>
+    void LLogLine::encode(Arg arg)
     {
-        if (arg != nullptr)
-            encode_c_string(arg, strlen(arg));
+        memcpy(buffer(), &arg, sizeof(Arg));
+        m_bytes_used += sizeof(Arg);
     }
 
-    void LLogLine::encode_c_string(char const *arg, size_t length)
+    template <typename Arg>
+    void LLogLine::encode(Arg arg, uint8_t type_id)
     {
-        if (length == 0)
-            return;
-
-        resize_buffer_if_needed(1 + length + 1);
-        char *b = buffer();
-        auto type_id = TupleIndex<char *, SupportedTypes>::value;
-        *reinterpret_cast<uint8_t *>(b++) = static_cast<uint8_t>(type_id);
-        memcpy(b, arg, length + 1);
-        m_bytes_used += 1 + length + 1;
+        resize_buffer_if_needed(sizeof(Arg) + sizeof(uint8_t));
+        encode<uint8_t>(type_id);
+        encode<Arg>(arg);
     }
 
-    void LLogLine::encode(string_literal_t arg)
+    /*
+     * Every call site is registered once and loglines only carry its id.
+     * Entries are never removed and live in fixed size chunks, so the consumer reads them without locking.
+     */
+    class SiteRegistry
     {
-        encode<string_literal_t>(arg, TupleIndex<string_literal_t, SupportedTypes>::value);
-    }
+    public:
+        struct Entry
+        {
+            LogSite site;
+            // "[file:function:line]", precomputed for the formatter.
+            std::string location;
+        };
 
-    LLogLine &LLogLine::operator<<(std::string const &arg)
-    {
-        encode_c_string(arg.c_str(), arg.length());
-        return *this;
-    }
+        // Told about every site as it is added, by the registering thread under the registry lock.
+        struct Listener
+        {
+            virtual ~Listener() = default;
+            virtual void site_added(uint32_t id, LogSite const &site) = 0;
+        };
 
-    LLogLine &LLogLine::operator<<(int32_t arg)
-    {
-        encode<int32_t>(arg, TupleIndex<int32_t, SupportedTypes>::value);
-        return *this;
-    }
+        SiteRegistry() : m_count(0)
+        {
+            for (auto &chunk : m_chunks)
+                chunk.store(nullptr, std::memory_order_relaxed);
+            add("", "", 0, LogLevel::INFO, nullptr);
+        }
 
-    LLogLine &LLogLine::operator<<(uint32_t arg)
-    {
-        encode<uint32_t>(arg, TupleIndex<uint32_t, SupportedTypes>::value);
-        return *this;
-    }
+        uint32_t add(char const *file, char const *function, uint32_t line, LogLevel level, char const *signature)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto key = std::make_tuple(file, function, line, level);
+            auto it = m_ids.find(key);
+            if (it != m_ids.end())
+                return it->second;
 
-    LLogLine &LLogLine::operator<<(int64_t arg)
-    {
-        encode<int64_t>(arg, TupleIndex<int64_t, SupportedTypes>::value);
-        return *this;
-    }
+            if (m_count == chunk_size * max_chunks)
+                return unknown_site;
 
-    LLogLine &LLogLine::operator<<(uint64_t arg)
-    {
-        encode<uint64_t>(arg, TupleIndex<uint64_t, SupportedTypes>::value);
-        return *this;
-    }
+            uint32_t const id = m_count++;
+            Entry *chunk = m_chunks[id >> chunk_bits].load(std::memory_order_relaxed);
+            if (chunk == nullptr)
+            {
+                chunk = new Entry[chunk_size];
+                m_chunks[id >> chunk_bits].store(chunk, std::memory_order_release);
+            }
 
-    LLogLine &LLogLine::operator<<(double arg)
-    {
-        encode<double>(arg, TupleIndex<double, SupportedTypes>::value);
-        return *this;
-    }
+            Entry &entry = chunk[id & (chunk_size - 1)];
+            fill(entry, file, function, line, level, signature);
 
-    LLogLine &LLogLine::operator<<(char arg)
-    {
-        encode<char>(arg, TupleIndex<char, SupportedTypes>::value);
-        return *this;
-    }
+            m_ids.emplace(key, id);
+            for (Listener *listener : m_listeners)
+                listener->site_added(id, entry.site);
+            return id;
+        }
 
-    struct BufferBase
-    {
-        virtual ~BufferBase() = default;
+        uint32_t size()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_count;
+        }
 
-        virtual void push(LLogLine &&logline) = 0;
-        virtual bool try_pop(LLogLine &logline) = 0;
-    };
+        // Replays the sites registered so far, then passes on new ones until unsubscribed.
+        void subscribe(Listener *listener)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (uint32_t id = 0; id < m_count; ++id)
+                listener->site_added(id, get(id).site);
+            m_listeners.push_back(listener);
+        }
 
-    struct SpinLock
-    {
-        SpinLock(std::atomic_flag &flag) : m_flag(flag)
+        void unsubscribe(Listener *listener)
         {
-            while (m_flag.test_and_set(std::memory_order_acquire))
-                ;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_listeners.erase(std::remove(m_listeners.begin(), m_listeners.end(), listener), m_listeners.end());
         }
-        ~SpinLock()
+
+        // Ids reach the consumer inside loglines, after the registering thread has published them.
+        Entry const &get(uint32_t id) const
         {
-            m_flag.clear(std::memory_order_release);
+            return m_chunks[id >> chunk_bits].load(std::memory_order_acquire)[id & (chunk_size - 1)];
         }
 
+        static void fill(Entry &entry, char const *file, char const *function, uint32_t line, LogLevel level, char const *signature)
+        {
+            entry.site.file = file != nullptr ? file : "";
+            entry.site.function = function != nullptr ? function : "";
+            entry.site.line = line;
+            entry.site.level = level;
+            entry.site.signature = signature;
+            entry.location.assign("[").append(entry.site.file).append(":").append(entry.site.function).append(":");
+            entry.location.append(std::to_string(line)).append("]");
+        }
+
+        static constexpr uint32_t unknown_site = 0;
+
     private:
-        std::atomic_flag &m_flag;
+        static constexpr uint32_t chunk_bits = 10;
+        static constexpr uint32_t chunk_size = 1u << chunk_bits;
+        static constexpr uint32_t max_chunks = 4096;
+
+        std::atomic<Entry *> m_chunks[max_chunks];
+        std::mutex m_mutex;
+        uint32_t m_count;
+        std::map<std::tuple<char const *, char const *, uint32_t, LogLevel>, uint32_t> m_ids;
+        std::vector<Listener *> m_listeners;
     };
 
-    class RingBuffer : public BufferBase
+    constexpr uint32_t SiteRegistry::unknown_site;
+
+    // Never destroyed, the consumer may still format lines during static destruction.
+    SiteRegistry &site_registry()
     {
-    public:
-        struct alignas(64) Item
-        {
-            Item()
-                : flag{ATOMIC_FLAG_INIT}, written(0), logline(LogLevel::INFO, nullptr, nullptr, 0)
-            {
-            }
+        static SiteRegistry *registry = new SiteRegistry();
+        return *registry;
+    }
 
-            std::atomic_flag flag;
-            char written;
-            char padding[256 - sizeof(std::atomic_flag) - sizeof(char) - sizeof(LLogLine)];
-            LLogLine logline;
-        };
+    uint32_t register_site(char const *file, char const *function, uint32_t line, LogLevel level, char const *signature)
+    {
+        return site_registry().add(file, function, line, level, signature);
+    }
 
-        RingBuffer(size_t const size)
-            : m_size(size), m_ring(static_cast<Item *>(std::malloc(size * sizeof(Item)))), m_write_index(0), m_read_index(0)
+    /*
+     * The sites of a binary log or flight recorder being read back, under the ids of the process
+     * that wrote them. The strings belong to the reader, so the table lives only as long as it.
+     */
+    class SiteTable
+    {
+    public:
+        SiteTable()
         {
-            for (size_t i = 0; i < m_size; i++)
-            {
-                new (&m_ring[i]) Item();
-            }
-            static_assert(sizeof(Item) == 256, "Unexpected size != 256");
+            SiteRegistry::fill(m_unknown, "", "", 0, LogLevel::INFO, nullptr);
         }
 
-        ~RingBuffer()
+        void add(uint32_t id, char const *file, char const *function, uint32_t line, LogLevel level)
         {
-            for (size_t i = 0; i < m_size; i++)
-            {
-                m_ring[i].~Item();
-            }
-            std::free(m_ring);
+            SiteRegistry::fill(m_entries[id], file, function, line, level, nullptr);
         }
 
-        void push(LLogLine &&logline) override
+        bool contains(uint32_t id) const
         {
-            unsigned int write_index = m_write_index.fetch_add(1, std::memory_order_relaxed) % m_size;
-            Item &item = m_ring[write_index];
-            SpinLock spinlock(item.flag);
-            item.logline = std::move(logline);
-            item.written = 1;
+            return m_entries.count(id) != 0;
         }
 
-        bool try_pop(LLogLine &logline) override
+        SiteRegistry::Entry const &get(uint32_t id) const
         {
-            Item &item = m_ring[m_read_index % m_size];
-            SpinLock spinlock(item.flag);
-            if (item.written == 1)
-            {
-                logline = std::move(item.logline);
-                item.written = 0;
-                ++m_read_index;
-                return true;
-            }
-            return false;
+            auto it = m_entries.find(id);
+            return it != m_entries.end() ? it->second : m_unknown;
         }
 
-        RingBuffer(RingBuffer const &) = delete;
-        RingBuffer &operator=(RingBuffer const &) = delete;
+        void clear()
+        {
+            m_entries.clear();
+        }
 
     private:
-        size_t const m_size;
-        Item *m_ring;
-        std::atomic<unsigned int> m_write_index;
-        char pad[64];
-        unsigned int m_read_index;
+        std::unordered_map<uint32_t, SiteRegistry::Entry> m_entries;
+        SiteRegistry::Entry m_unknown;
     };
 
-    class Buffer
+    // Timestamp, thread id, site id and level, ahead of the arguments of every line.
+    constexpr size_t line_header_size = sizeof(int64_t) + sizeof(std::thread::id) + sizeof(uint32_t) + sizeof(LogLevel);
+
+    void encode_line_header(char *b, LogLevel level, uint32_t site_id)
     {
-    public:
-        struct Item
-        {
-            Item(LLogLine &&llogline) : logline(std::move(llogline)) {}
+        int64_t const timestamp = timestamp_now();
+        std::thread::id const thread_id = this_thread_id();
+        memcpy(b, &timestamp, sizeof(timestamp));
+        memcpy(b + sizeof(timestamp), &thread_id, sizeof(thread_id));
+        memcpy(b + sizeof(timestamp) + sizeof(thread_id), &site_id, sizeof(site_id));
+        memcpy(b + sizeof(timestamp) + sizeof(thread_id) + sizeof(site_id), &level, sizeof(level));
+    }
+
+    LLogLine::LLogLine(LogLevel level, uint32_t site_id)
+        : m_bytes_used(line_header_size), m_buffer_size(sizeof(m_stack_buffer))
+    {
+        encode_line_header(m_stack_buffer, level, site_id);
+    }
+
+    LLogLine::LLogLine(LogLevel level, char const *file, char const *function, uint32_t line)
+        : LLogLine(level, register_site(file, function, line, level))
+    {
+    }
+
+    LLogLine::~LLogLine() = default;
+
+    /*
+     * Formats loglines into a reusable char buffer without going through std::ostream.
+     * The "[YYYY-MM-DD HH:MM:SS." prefix is cached and only rebuilt when the second changes.
+     */
+    class LineFormatter
+    {
+    public:
+        LineFormatter()
+            : m_size(0), m_capacity(1024), m_buffer(new char[m_capacity]), m_fraction_digits(6), m_sites(nullptr), m_cached_second(UINT64_MAX)
+        {
+        }
+
+        // Digits printed after the second, 6 or 9.
+        void set_fraction_digits(uint8_t digits)
+        {
+            m_fraction_digits = digits;
+        }
+
+        // Resolves site ids through sites rather than the registry, for lines read back from a file.
+        void set_sites(SiteTable const *sites)
+        {
+            m_sites = sites;
+        }
+
+        void clear()
+        {
+            m_size = 0;
+        }
+
+        char const *data() const
+        {
+            return m_buffer.get();
+        }
+
+        size_t size() const
+        {
+            return m_size;
+        }
+
+        // Appends one formatted line including the trailing newline, stamped with the given wall-clock time.
+        LogLevel format(LLogLine const &logline, uint64_t nanoseconds, LogFormat format = LogFormat::TEXT);
+
+        void append(char c)
+        {
+            *reserve(1) = c;
+            ++m_size;
+        }
+
+        void append(char const *s, size_t length)
+        {
+            memcpy(reserve(length), s, length);
+            m_size += length;
+        }
+
+        void append(char const *s)
+        {
+            if (s != nullptr)
+                append(s, strlen(s));
+        }
+
+        void append_unsigned(uint64_t value)
+        {
+            char digits[20];
+            char *const end = digits + sizeof(digits);
+            char *p = end;
+            while (value >= 100)
+            {
+                p -= 2;
+                memcpy(p, digit_pairs + (value % 100) * 2, 2);
+                value /= 100;
+            }
+            if (value >= 10)
+            {
+                p -= 2;
+                memcpy(p, digit_pairs + value * 2, 2);
+            }
+            else
+            {
+                *--p = static_cast<char>('0' + value);
+            }
+            append(p, end - p);
+        }
+
+        void append_signed(int64_t value)
+        {
+            if (value < 0)
+            {
+                append('-');
+                append_unsigned(0 - static_cast<uint64_t>(value));
+                return;
+            }
+            append_unsigned(static_cast<uint64_t>(value));
+        }
+
+        // Same output as std::ostream's default (%g, precision 6).
+        void append_double(double value);
+
+        // "[YYYY-MM-DD HH:MM:SS.ffffff]" with 6 or 9 fraction digits.
+        void append_timestamp(uint64_t nanoseconds);
+
+    private:
+        char *reserve(size_t length)
+        {
+            if (m_size + length > m_capacity)
+            {
+                m_capacity = std::max(2 * m_capacity, m_size + length);
+                std::unique_ptr<char[]> buffer(new char[m_capacity]);
+                memcpy(buffer.get(), m_buffer.get(), m_size);
+                m_buffer.swap(buffer);
+            }
+            return m_buffer.get() + m_size;
+        }
+
+        void append_two_digits(char *p, uint32_t value)
+        {
+            memcpy(p, digit_pairs + value * 2, 2);
+        }
+
+        void append_thread_id(std::thread::id const &id);
+
+        SiteRegistry::Entry const &site(uint32_t id) const
+        {
+            return m_sites != nullptr ? m_sites->get(id) : site_registry().get(id);
+        }
+
+        LogLevel format_structured(LLogLine const &logline, uint64_t nanoseconds, bool json);
+
+        static bool is_bare(uint8_t type_id, char const *b);
+
+        // Decodes one argument at the end of the buffer and moves its text to m_scratch.
+        char const *decode_to_scratch(uint8_t type_id, char const *b);
+
+        // A JSON string, quotes included. Also valid as a quoted logfmt value.
+        void append_quoted(char const *s, size_t length);
+
+        void append_value(char const *s, size_t length, bool json);
+
+    private:
+        static char const digit_pairs[201];
+
+        size_t m_size;
+        size_t m_capacity;
+        std::unique_ptr<char[]> m_buffer;
+        uint8_t m_fraction_digits;
+        SiteTable const *m_sites;
+        uint64_t m_cached_second;
+        char m_cached_prefix[21];
+        std::thread::id m_cached_thread_id;
+        std::string m_cached_thread_string;
+        std::unordered_map<std::thread::id, std::string> m_thread_strings;
+        std::string m_scratch;
+    };
+
+    char const LineFormatter::digit_pairs[201] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+    struct LevelPrefix
+    {
+        char const *text;
+        size_t length;
+    };
+
+    LevelPrefix const level_prefixes[] = {{"[TRACE]", 7}, {"[DEBUG]", 7}, {"[INFO]", 6}, {"[WARN]", 6}, {"[CRIT]", 6}};
+
+    void LineFormatter::append_timestamp(uint64_t nanoseconds)
+    {
+        uint64_t const second = nanoseconds / 1000000000;
+        if (second != m_cached_second)
+        {
+            // Civil date from days since epoch, see http://howardhinnant.github.io/date_algorithms.html
+            uint64_t const z = second / 86400 + 719468;
+            uint64_t const era = z / 146097;
+            uint32_t const doe = static_cast<uint32_t>(z - era * 146097);
+            uint32_t const yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+            uint32_t const doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+            uint32_t const mp = (5 * doy + 2) / 153;
+            uint32_t const day = doy - (153 * mp + 2) / 5 + 1;
+            uint32_t const month = mp < 10 ? mp + 3 : mp - 9;
+            uint32_t const year = static_cast<uint32_t>(yoe + era * 400 + (month <= 2));
+            uint32_t const seconds_of_day = static_cast<uint32_t>(second % 86400);
+
+            char *p = m_cached_prefix;
+            *p++ = '[';
+            append_two_digits(p, year / 100 % 100);
+            append_two_digits(p + 2, year % 100);
+            p[4] = '-';
+            append_two_digits(p + 5, month);
+            p[7] = '-';
+            append_two_digits(p + 8, day);
+            p[10] = ' ';
+            append_two_digits(p + 11, seconds_of_day / 3600);
+            p[13] = ':';
+            append_two_digits(p + 14, seconds_of_day / 60 % 60);
+            p[16] = ':';
+            append_two_digits(p + 17, seconds_of_day % 60);
+            p[19] = '.';
+            m_cached_second = second;
+        }
+
+        char *p = reserve(sizeof(m_cached_prefix) + 10);
+        memcpy(p, m_cached_prefix, sizeof(m_cached_prefix));
+        p += sizeof(m_cached_prefix);
+        uint32_t fraction = static_cast<uint32_t>(nanoseconds % 1000000000);
+        if (m_fraction_digits == 9)
+        {
+            p[0] = static_cast<char>('0' + fraction / 100000000);
+            fraction %= 100000000;
+            append_two_digits(p + 1, fraction / 1000000);
+            p += 3;
+            fraction %= 1000000;
+        }
+        else
+        {
+            fraction /= 1000;
+        }
+        append_two_digits(p, fraction / 10000);
+        append_two_digits(p + 2, fraction / 100 % 100);
+        append_two_digits(p + 4, fraction % 100);
+        p[6] = ']';
+        m_size += sizeof(m_cached_prefix) + m_fraction_digits + 1;
+    }
+
+    void LineFormatter::append_thread_id(std::thread::id const &id)
+    {
+        if (id != m_cached_thread_id || m_cached_thread_string.empty())
+        {
+            auto it = m_thread_strings.find(id);
+            if (it == m_thread_strings.end())
+            {
+                std::ostringstream os;
+                os << id;
+                it = m_thread_strings.emplace(id, os.str()).first;
+            }
+            m_cached_thread_id = id;
+            m_cached_thread_string = it->second;
+        }
+        append(m_cached_thread_string.data(), m_cached_thread_string.size());
+    }
+
+    void LineFormatter::append_double(double value)
+    {
+        static double const powers[] = {1e-4, 1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3, 1e4, 1e5};
+        static double const scales[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+        static uint32_t const divisors[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+
+        double const magnitude = value < 0 ? -value : value;
+        if (magnitude >= 1e-4 && magnitude < 1e6)
+        {
+            // Six significant digits in fixed notation, trailing zeros stripped.
+            int exponent = 5;
+            while (magnitude < powers[exponent + 4])
+                --exponent;
+            int decimals = 5 - exponent;
+            double const scaled = magnitude * scales[decimals];
+            double const integral = std::floor(scaled);
+            double const fraction = scaled - integral;
+            uint64_t digits = static_cast<uint64_t>(integral) + (fraction > 0.5 ? 1 : 0);
+
+            // Close ties and carries into the next exponent are left to printf's exact rounding.
+            if (std::fabs(fraction - 0.5) > 1e-6 && digits < 1000000)
+            {
+                if (value < 0)
+                    append('-');
+                while (decimals > 0 && digits % 10 == 0)
+                {
+                    digits /= 10;
+                    --decimals;
+                }
+                append_unsigned(digits / divisors[decimals]);
+                if (decimals > 0)
+                {
+                    uint32_t fractional = static_cast<uint32_t>(digits % divisors[decimals]);
+                    char *p = reserve(decimals + 1);
+                    *p = '.';
+                    for (int i = decimals; i > 0; --i, fractional /= 10)
+                        p[i] = static_cast<char>('0' + fractional % 10);
+                    m_size += decimals + 1;
+                }
+                return;
+            }
+        }
+        else if (value == 0 && !std::signbit(value))
+        {
+            append('0');
+            return;
+        }
+
+        char buffer[32];
+        int const length = snprintf(buffer, sizeof(buffer), "%g", value);
+        append(buffer, length);
+    }
+
+    void TextWriter::append(char c)
+    {
+        m_formatter.append(c);
+    }
+
+    void TextWriter::append(char const *s, size_t length)
+    {
+        m_formatter.append(s, length);
+    }
+
+    void TextWriter::append(char const *s)
+    {
+        m_formatter.append(s);
+    }
+
+    void TextWriter::append_signed(int64_t value)
+    {
+        m_formatter.append_signed(value);
+    }
+
+    void TextWriter::append_unsigned(uint64_t value)
+    {
+        m_formatter.append_unsigned(value);
+    }
+
+    void TextWriter::append_double(double value)
+    {
+        m_formatter.append_double(value);
+    }
+
+    // Ids are indexes, a slot is written once before its id is handed out.
+    constexpr uint32_t max_user_formats = 4096;
+    std::atomic<UserFormat> user_formats[max_user_formats];
+    std::atomic<uint32_t> user_format_count{0};
+
+    uint32_t register_user_format(UserFormat format)
+    {
+        uint32_t const id = user_format_count.fetch_add(1, std::memory_order_relaxed);
+        if (id >= max_user_formats)
+            return UINT32_MAX;
+        user_formats[id].store(format, std::memory_order_release);
+        return id;
+    }
+
+    template <typename Arg>
+    char const *decode(LineFormatter &formatter, char const *b);
+
+    template <>
+    char const *decode<char>(LineFormatter &formatter, char const *b)
+    {
+        formatter.append(*b);
+        return b + sizeof(char);
+    }
+
+    template <>
+    char const *decode<uint32_t>(LineFormatter &formatter, char const *b)
+    {
+        uint32_t arg;
+        memcpy(&arg, b, sizeof(arg));
+        formatter.append_unsigned(arg);
+        return b + sizeof(arg);
+    }
+
+    template <>
+    char const *decode<uint64_t>(LineFormatter &formatter, char const *b)
+    {
+        uint64_t arg;
+        memcpy(&arg, b, sizeof(arg));
+        formatter.append_unsigned(arg);
+        return b + sizeof(arg);
+    }
+
+    template <>
+    char const *decode<int32_t>(LineFormatter &formatter, char const *b)
+    {
+        int32_t arg;
+        memcpy(&arg, b, sizeof(arg));
+        formatter.append_signed(arg);
+        return b + sizeof(arg);
+    }
+
+    template <>
+    char const *decode<int64_t>(LineFormatter &formatter, char const *b)
+    {
+        int64_t arg;
+        memcpy(&arg, b, sizeof(arg));
+        formatter.append_signed(arg);
+        return b + sizeof(arg);
+    }
+
+    template <>
+    char const *decode<double>(LineFormatter &formatter, char const *b)
+    {
+        double arg;
+        memcpy(&arg, b, sizeof(arg));
+        formatter.append_double(arg);
+        return b + sizeof(arg);
+    }
+
+    template <>
+    char const *decode<LLogLine::string_literal_t>(LineFormatter &formatter, char const *b)
+    {
+        LLogLine::string_literal_t s = load<LLogLine::string_literal_t>(b);
+        formatter.append(s.m_s);
+        return b + sizeof(LLogLine::string_literal_t);
+    }
+
+    template <>
+    char const *decode<char *>(LineFormatter &formatter, char const *b)
+    {
+        size_t const length = strlen(b);
+        formatter.append(b, length);
+        return b + length + 1;
+    }
+
+    template <>
+    char const *decode<bool>(LineFormatter &formatter, char const *b)
+    {
+        formatter.append(*b ? "true" : "false");
+        return b + sizeof(bool);
+    }
+
+    template <>
+    char const *decode<int8_t>(LineFormatter &formatter, char const *b)
+    {
+        formatter.append_signed(static_cast<int8_t>(*b));
+        return b + sizeof(int8_t);
+    }
+
+    template <>
+    char const *decode<uint8_t>(LineFormatter &formatter, char const *b)
+    {
+        formatter.append_unsigned(static_cast<uint8_t>(*b));
+        return b + sizeof(uint8_t);
+    }
+
+    template <>
+    char const *decode<int16_t>(LineFormatter &formatter, char const *b)
+    {
+        int16_t arg;
+        memcpy(&arg, b, sizeof(arg));
+        formatter.append_signed(arg);
+        return b + sizeof(arg);
+    }
+
+    template <>
+    char const *decode<uint16_t>(LineFormatter &formatter, char const *b)
+    {
+        uint16_t arg;
+        memcpy(&arg, b, sizeof(arg));
+        formatter.append_unsigned(arg);
+        return b + sizeof(arg);
+    }
+
+    template <>
+    char const *decode<float>(LineFormatter &formatter, char const *b)
+    {
+        float arg;
+        memcpy(&arg, b, sizeof(arg));
+        formatter.append_double(arg);
+        return b + sizeof(arg);
+    }
+
+    template <>
+    char const *decode<void const *>(LineFormatter &formatter, char const *b)
+    {
+        static char const hex[] = "0123456789abcdef";
+        uintptr_t arg;
+        memcpy(&arg, b, sizeof(arg));
+        char digits[2 + 2 * sizeof(arg)];
+        char *const end = digits + sizeof(digits);
+        char *p = end;
+        do
+        {
+            *--p = hex[arg & 15];
+            arg >>= 4;
+        } while (arg != 0);
+        *--p = 'x';
+        *--p = '0';
+        formatter.append(p, end - p);
+        return b + sizeof(arg);
+    }
+
+    template <>
+    char const *decode<LLogLine::sized_string_t>(LineFormatter &formatter, char const *b)
+    {
+        uint32_t length;
+        memcpy(&length, b, sizeof(length));
+        formatter.append(b + sizeof(length), length);
+        return b + sizeof(length) + length;
+    }
+
+    template <>
+    char const *decode<LLogLine::hex_dump_t>(LineFormatter &formatter, char const *b)
+    {
+        static char const hex[] = "0123456789abcdef";
+        uint32_t length;
+        memcpy(&length, b, sizeof(length));
+        b += sizeof(length);
+        for (uint32_t i = 0; i < length; ++i)
+        {
+            unsigned char const byte = static_cast<unsigned char>(b[i]);
+            char const pair[3] = {' ', hex[byte >> 4], hex[byte & 15]};
+            formatter.append(i == 0 ? pair + 1 : pair, i == 0 ? 2 : 3);
+        }
+        return b + length;
+    }
+
+    // Without a registered format the state is hex dumped.
+    template <>
+    char const *decode<LLogLine::user_type_t>(LineFormatter &formatter, char const *b)
+    {
+        uint32_t header[2];
+        memcpy(header, b, sizeof(header));
+        UserFormat const format = header[0] < max_user_formats ? user_formats[header[0]].load(std::memory_order_acquire) : nullptr;
+        if (format == nullptr)
+            return decode<LLogLine::hex_dump_t>(formatter, b + sizeof(uint32_t));
+        TextWriter out(formatter);
+        format(b + sizeof(header), header[1], out);
+        return b + sizeof(header) + header[1];
+    }
+
+    // TEXT output, the value follows.
+    template <>
+    char const *decode<LLogLine::field_name_t>(LineFormatter &formatter, char const *b)
+    {
+        LLogLine::field_name_t key = load<LLogLine::field_name_t>(b);
+        formatter.append(' ');
+        formatter.append(key.m_s);
+        formatter.append('=');
+        return b + sizeof(LLogLine::field_name_t);
+    }
+
+    typedef char const *(*Decoder)(LineFormatter &formatter, char const *b);
+
+    // Indexed by the type ids of SupportedTypes.
+    Decoder const decoders[] = {
+        &decode<std::tuple_element<0, SupportedTypes>::type>,
+        &decode<std::tuple_element<1, SupportedTypes>::type>,
+        &decode<std::tuple_element<2, SupportedTypes>::type>,
+        &decode<std::tuple_element<3, SupportedTypes>::type>,
+        &decode<std::tuple_element<4, SupportedTypes>::type>,
+        &decode<std::tuple_element<5, SupportedTypes>::type>,
+        &decode<std::tuple_element<6, SupportedTypes>::type>,
+        &decode<std::tuple_element<7, SupportedTypes>::type>,
+        &decode<std::tuple_element<8, SupportedTypes>::type>,
+        &decode<std::tuple_element<9, SupportedTypes>::type>,
+        &decode<std::tuple_element<10, SupportedTypes>::type>,
+        &decode<std::tuple_element<11, SupportedTypes>::type>,
+        &decode<std::tuple_element<12, SupportedTypes>::type>,
+        &decode<std::tuple_element<13, SupportedTypes>::type>,
+        &decode<std::tuple_element<14, SupportedTypes>::type>,
+        &decode<std::tuple_element<15, SupportedTypes>::type>,
+        &decode<std::tuple_element<16, SupportedTypes>::type>,
+        &decode<std::tuple_element<17, SupportedTypes>::type>,
+        &decode<std::tuple_element<18, SupportedTypes>::type>,
+    };
+
+    static_assert(sizeof(decoders) / sizeof(decoders[0]) == std::tuple_size<SupportedTypes>::value, "Missing decoder");
+
+    LogLevel LineFormatter::format(LLogLine const &logline, uint64_t nanoseconds, LogFormat format)
+    {
+        if (format == LogFormat::JSON || format == LogFormat::LOGFMT)
+            return format_structured(logline, nanoseconds, format == LogFormat::JSON);
+
+        char const *b = !logline.m_heap_buffer ? logline.m_stack_buffer : logline.m_heap_buffer.get();
+        char const *const end = b + logline.m_bytes_used;
+        b += sizeof(uint64_t);
+        std::thread::id threadid = load<std::thread::id>(b);
+        b += sizeof(std::thread::id);
+        uint32_t site_id = load<uint32_t>(b);
+        b += sizeof(uint32_t);
+        LogLevel loglevel = load<LogLevel>(b);
+        b += sizeof(LogLevel);
+
+        append_timestamp(nanoseconds);
+        LevelPrefix const &level = level_prefixes[static_cast<size_t>(loglevel)];
+        append(level.text, level.length);
+        append('[');
+        append_thread_id(threadid);
+        append(']');
+        std::string const &location = site(site_id).location;
+        append(location.data(), location.size());
+
+        while (b < end)
+        {
+            uint8_t const type_id = static_cast<uint8_t>(*b++);
+            if (type_id >= std::tuple_size<SupportedTypes>::value)
+                break;
+            b = decoders[type_id](*this, b);
+        }
+
+        append('\n');
+        return loglevel;
+    }
+
+    // Numbers and booleans stay bare, except inf and nan which JSON has no literal for.
+    bool LineFormatter::is_bare(uint8_t type_id, char const *b)
+    {
+        switch (type_id)
+        {
+        case TupleIndex<bool, SupportedTypes>::value:
+        case TupleIndex<int8_t, SupportedTypes>::value:
+        case TupleIndex<uint8_t, SupportedTypes>::value:
+        case TupleIndex<int16_t, SupportedTypes>::value:
+        case TupleIndex<uint16_t, SupportedTypes>::value:
+        case TupleIndex<int32_t, SupportedTypes>::value:
+        case TupleIndex<uint32_t, SupportedTypes>::value:
+        case TupleIndex<int64_t, SupportedTypes>::value:
+        case TupleIndex<uint64_t, SupportedTypes>::value:
+            return true;
+        case TupleIndex<float, SupportedTypes>::value:
+        {
+            float number;
+            memcpy(&number, b, sizeof(number));
+            return std::isfinite(number);
+        }
+        case TupleIndex<double, SupportedTypes>::value:
+        {
+            double number;
+            memcpy(&number, b, sizeof(number));
+            return std::isfinite(number);
+        }
+        }
+        return false;
+    }
+
+    char const *LineFormatter::decode_to_scratch(uint8_t type_id, char const *b)
+    {
+        size_t const start = m_size;
+        b = decoders[type_id](*this, b);
+        m_scratch.append(m_buffer.get() + start, m_size - start);
+        m_size = start;
+        return b;
+    }
+
+    void LineFormatter::append_quoted(char const *s, size_t length)
+    {
+        static char const hex[] = "0123456789abcdef";
+        append('"');
+        char const *const end = s + length;
+        while (s < end)
+        {
+            char const *plain = s;
+            while (s < end && *s != '"' && *s != '\\' && static_cast<unsigned char>(*s) >= 0x20)
+                ++s;
+            append(plain, s - plain);
+            if (s == end)
+                break;
+            unsigned char const c = static_cast<unsigned char>(*s++);
+            char escape[6] = {'\\', static_cast<char>(c), 0, 0, 0, 0};
+            size_t escape_length = 2;
+            if (c == '\n')
+                escape[1] = 'n';
+            else if (c == '\t')
+                escape[1] = 't';
+            else if (c == '\r')
+                escape[1] = 'r';
+            else if (c < 0x20)
+            {
+                memcpy(escape + 1, "u00", 3);
+                escape[4] = hex[c >> 4];
+                escape[5] = hex[c & 15];
+                escape_length = 6;
+            }
+            append(escape, escape_length);
+        }
+        append('"');
+    }
+
+    // logfmt leaves a value bare unless it is empty or has spaces, quotes, '=' or control characters.
+    void LineFormatter::append_value(char const *s, size_t length, bool json)
+    {
+        bool quote = json || length == 0;
+        for (size_t i = 0; i < length && !quote; ++i)
+            quote = static_cast<unsigned char>(s[i]) <= ' ' || s[i] == '"' || s[i] == '=' || s[i] == '\\';
+        if (quote)
+            append_quoted(s, length);
+        else
+            append(s, length);
+    }
+
+    /*
+     * Message arguments are joined into msg and the fields follow it in statement order, so the
+     * arguments are walked twice. Everything is decoded with the TEXT decoders and then escaped.
+     */
+    LogLevel LineFormatter::format_structured(LLogLine const &logline, uint64_t nanoseconds, bool json)
+    {
+        char const *b = !logline.m_heap_buffer ? logline.m_stack_buffer : logline.m_heap_buffer.get();
+        char const *const end = b + logline.m_bytes_used;
+        b += sizeof(uint64_t);
+        std::thread::id threadid = load<std::thread::id>(b);
+        b += sizeof(std::thread::id);
+        uint32_t site_id = load<uint32_t>(b);
+        b += sizeof(uint32_t);
+        LogLevel loglevel = load<LogLevel>(b);
+        b += sizeof(LogLevel);
+        char const *const arguments = b;
+        uint8_t const key_type = TupleIndex<LLogLine::field_name_t, SupportedTypes>::value;
+        uint8_t const type_count = std::tuple_size<SupportedTypes>::value;
+
+        // "[YYYY-MM-DD HH:MM:SS.ffffff]" becomes a quoted string in place.
+        append(json ? "{\"time\":" : "time=");
+        size_t const time_start = m_size;
+        append_timestamp(nanoseconds);
+        m_buffer[time_start] = '"';
+        m_buffer[m_size - 1] = '"';
+
+        LevelPrefix const &level = level_prefixes[static_cast<size_t>(loglevel)];
+        append(json ? ",\"level\":\"" : " level=");
+        append(level.text + 1, level.length - 2);
+        append(json ? "\",\"thread\":\"" : " thread=");
+        append_thread_id(threadid);
+        LogSite const &site = this->site(site_id).site;
+        append(json ? "\",\"file\":" : " file=");
+        append_value(site.file, strlen(site.file), json);
+        append(json ? ",\"function\":" : " function=");
+        append_value(site.function, strlen(site.function), json);
+        append(json ? ",\"line\":" : " line=");
+        append_unsigned(site.line);
+
+        m_scratch.clear();
+        for (b = arguments; b < end;)
+        {
+            uint8_t const type_id = static_cast<uint8_t>(*b++);
+            if (type_id >= type_count)
+                break;
+            if (type_id != key_type)
+            {
+                b = decode_to_scratch(type_id, b);
+                continue;
+            }
+            // Skips the field, its value is rendered below.
+            b += sizeof(LLogLine::field_name_t);
+            if (b >= end || static_cast<uint8_t>(*b) >= type_count)
+                break;
+            size_t const message_size = m_scratch.size();
+            b = decode_to_scratch(static_cast<uint8_t>(*b), b + 1);
+            m_scratch.resize(message_size);
+        }
+        if (!m_scratch.empty())
+        {
+            append(json ? ",\"msg\":" : " msg=");
+            append_value(m_scratch.data(), m_scratch.size(), json);
+        }
+
+        for (b = arguments; b < end;)
+        {
+            uint8_t const type_id = static_cast<uint8_t>(*b++);
+            if (type_id >= type_count)
+                break;
+            m_scratch.clear();
+            if (type_id != key_type)
+            {
+                b = decode_to_scratch(type_id, b);
+                continue;
+            }
+            char const *const key = load<LLogLine::field_name_t>(b).m_s;
+            b += sizeof(LLogLine::field_name_t);
+            uint8_t const value_type = b < end ? static_cast<uint8_t>(*b++) : type_count;
+            if (value_type >= type_count || value_type == key_type)
+                break;
+
+            append(json ? ',' : ' ');
+            if (json)
+                append_quoted(key, strlen(key));
+            else
+                append(key);
+            append(json ? ':' : '=');
+
+            bool const bare = is_bare(value_type, b);
+            b = decode_to_scratch(value_type, b);
+            if (bare)
+                append(m_scratch.data(), m_scratch.size());
+            else
+                append_value(m_scratch.data(), m_scratch.size(), json);
+        }
+
+        if (json)
+            append('}');
+        append('\n');
+        return loglevel;
+    }
+
+    void LLogLine::stringify(std::ostream &os)
+    {
+        static thread_local TimestampConverter converter;
+        static thread_local LineFormatter formatter;
+        formatter.clear();
+        formatter.set_fraction_digits(converter.fraction_digits());
+        LogLevel const loglevel = formatter.format(*this, converter.to_nanoseconds(timestamp()));
+        os.write(formatter.data(), formatter.size());
+
+        if (loglevel >= LogLevel::CRIT)
+            os.flush();
+    }
+
+    uint64_t LLogLine::timestamp() const
+    {
+        char const *b = !m_heap_buffer ? m_stack_buffer : m_heap_buffer.get();
+        return load<uint64_t>(b);
+    }
+
+    char *LLogLine::buffer()
+    {
+        return !m_heap_buffer ? &m_stack_buffer[m_bytes_used] : &(m_heap_buffer.get())[m_bytes_used];
+    }
+
+    void LLogLine::resize_buffer_if_needed(size_t additional_bytes)
+    {
+        size_t const required_size = m_bytes_used + additional_bytes;
+        if (required_size <= m_buffer_size)
+            return;
+
+        if (!m_heap_buffer)
+        {
+            m_buffer_size = std::max(static_cast<size_t>(512), required_size);
+            m_heap_buffer.reset(new char[m_buffer_size]);
+            memcpy(m_heap_buffer.get(), m_stack_buffer, m_bytes_used);
+            return;
+        }
+        else
+        {
+            m_buffer_size = std::max(static_cast<size_t>(2 * m_buffer_size), required_size);
+            std::unique_ptr<char[]> new_heap_buffer(new char[m_buffer_size]);
+            memcpy(new_heap_buffer.get(), m_heap_buffer.get(), m_bytes_used);
+            m_heap_buffer.swap(new_heap_buffer);
+        }
+    }
+
+    void LLogLine::encode(char const *arg)
+    {
+        if (arg != nullptr)
+            encode_c_string(arg, strlen(arg));
+    }
+
+    void LLogLine::encode(char *arg)
+    {
+        if (arg != nullptr)
+            encode_c_string(arg, strlen(arg));
+    }
+
+    void LLogLine::encode_c_string(char const *arg, size_t length)
+    {
+        if (length == 0)
+            return;
+
+        resize_buffer_if_needed(1 + length + 1);
+        char *b = buffer();
+        auto type_id = TupleIndex<char *, SupportedTypes>::value;
+        *reinterpret_cast<uint8_t *>(b++) = static_cast<uint8_t>(type_id);
+        memcpy(b, arg, length + 1);
+        m_bytes_used += 1 + length + 1;
+    }
+
+    void LLogLine::encode(string_literal_t arg)
+    {
+        encode<string_literal_t>(arg, TupleIndex<string_literal_t, SupportedTypes>::value);
+    }
+
+    size_t LLogLine::begin_field(char const *key)
+    {
+        encode<field_name_t>(field_name_t(key), TupleIndex<field_name_t, SupportedTypes>::value);
+        return m_bytes_used;
+    }
+
+    // Empty strings encode nothing, a field always gets a value.
+    void LLogLine::end_field(size_t used)
+    {
+        if (m_bytes_used != used)
+            return;
+        resize_buffer_if_needed(2);
+        char *b = buffer();
+        b[0] = static_cast<char>(TupleIndex<char *, SupportedTypes>::value);
+        b[1] = '\0';
+        m_bytes_used += 2;
+    }
+
+    void LLogLine::encode_sized(uint8_t type_id, void const *data, uint32_t length)
+    {
+        resize_buffer_if_needed(1 + sizeof(length) + length);
+        char *b = buffer();
+        *b = static_cast<char>(type_id);
+        memcpy(b + 1, &length, sizeof(length));
+        if (length != 0)
+            memcpy(b + 1 + sizeof(length), data, length);
+        m_bytes_used += 1 + sizeof(length) + length;
+    }
+
+    char *LLogLine::reserve_user_type(uint32_t format_id, size_t size)
+    {
+        uint32_t const header[2] = {format_id, static_cast<uint32_t>(size)};
+        resize_buffer_if_needed(1 + sizeof(header) + size);
+        char *b = buffer();
+        *b = static_cast<char>(TupleIndex<user_type_t, SupportedTypes>::value);
+        memcpy(b + 1, header, sizeof(header));
+        m_bytes_used += 1 + sizeof(header) + size;
+        return b + 1 + sizeof(header);
+    }
+
+    void LLogLine::encode_pointer(void const *arg)
+    {
+        encode<void const *>(arg, TupleIndex<void const *, SupportedTypes>::value);
+    }
+
+    LLogLine &LLogLine::operator<<(std::string const &arg)
+    {
+        encode_sized(TupleIndex<sized_string_t, SupportedTypes>::value, arg.data(), static_cast<uint32_t>(std::min<size_t>(arg.size(), UINT32_MAX)));
+        return *this;
+    }
+
+#if __cplusplus >= 201703L
+    LLogLine &LLogLine::operator<<(std::string_view arg)
+    {
+        encode_sized(TupleIndex<sized_string_t, SupportedTypes>::value, arg.data(), static_cast<uint32_t>(std::min<size_t>(arg.size(), UINT32_MAX)));
+        return *this;
+    }
+#endif
+
+    LLogLine &LLogLine::operator<<(Hex arg)
+    {
+        encode_sized(TupleIndex<hex_dump_t, SupportedTypes>::value, arg.data, arg.length);
+        return *this;
+    }
+
+    LLogLine &LLogLine::operator<<(bool arg)
+    {
+        encode<bool>(arg, TupleIndex<bool, SupportedTypes>::value);
+        return *this;
+    }
+
+    LLogLine &LLogLine::operator<<(int8_t arg)
+    {
+        encode<int8_t>(arg, TupleIndex<int8_t, SupportedTypes>::value);
+        return *this;
+    }
+
+    LLogLine &LLogLine::operator<<(uint8_t arg)
+    {
+        encode<uint8_t>(arg, TupleIndex<uint8_t, SupportedTypes>::value);
+        return *this;
+    }
+
+    LLogLine &LLogLine::operator<<(int16_t arg)
+    {
+        encode<int16_t>(arg, TupleIndex<int16_t, SupportedTypes>::value);
+        return *this;
+    }
+
+    LLogLine &LLogLine::operator<<(uint16_t arg)
+    {
+        encode<uint16_t>(arg, TupleIndex<uint16_t, SupportedTypes>::value);
+        return *this;
+    }
+
+    LLogLine &LLogLine::operator<<(float arg)
+    {
+        encode<float>(arg, TupleIndex<float, SupportedTypes>::value);
+        return *this;
+    }
+
+    LLogLine &LLogLine::operator<<(int32_t arg)
+    {
+        encode<int32_t>(arg, TupleIndex<int32_t, SupportedTypes>::value);
+        return *this;
+    }
+
+    LLogLine &LLogLine::operator<<(uint32_t arg)
+    {
+        encode<uint32_t>(arg, TupleIndex<uint32_t, SupportedTypes>::value);
+        return *this;
+    }
+
+    LLogLine &LLogLine::operator<<(int64_t arg)
+    {
+        encode<int64_t>(arg, TupleIndex<int64_t, SupportedTypes>::value);
+        return *this;
+    }
+
+    LLogLine &LLogLine::operator<<(uint64_t arg)
+    {
+        encode<uint64_t>(arg, TupleIndex<uint64_t, SupportedTypes>::value);
+        return *this;
+    }
+
+    LLogLine &LLogLine::operator<<(double arg)
+    {
+        encode<double>(arg, TupleIndex<double, SupportedTypes>::value);
+        return *this;
+    }
+
+    LLogLine &LLogLine::operator<<(char arg)
+    {
+        encode<char>(arg, TupleIndex<char, SupportedTypes>::value);
+        return *this;
+    }
+
+    LLogLine &LLogLine::operator<<(Suppressed arg)
+    {
+        if (arg.count != 0)
+            *this << "[" << arg.count << " suppressed] ";
+        return *this;
+    }
+
+    /*
+     * Binary on-disk format. A file starts with binary_log_magic and a u8 count of timestamp
+     * fraction digits (6 or 9), followed by frames:
+     *   'S' u32 id, u32 length, bytes                                   defines the next string
+     *   'T' u32 site id, u32 file, u32 function, u32 line, u8 level     defines a call site
+     *   'R' u32 length, payload                                         one encoded logline
+     * A record payload is the encoded logline with its timestamp converted to wall-clock nanoseconds
+     * and every string_literal_t and field_name_t replaced by its u32 string id. Strings and sites are defined before
+     * their first use and the ids restart after every magic, so each rolled file decodes on its own.
+     */
+    char const binary_log_magic[8] = {'L', 'L', 'O', 'G', 'B', 'I', 'N', 6};
+
+    class BinaryCodec
+    {
+        friend class FlightRecorder;
+
+    public:
+        struct WriteState
+        {
+            void reset()
+            {
+                string_ids.clear();
+                sites.clear();
+            }
+
+            std::unordered_map<char const *, uint32_t> string_ids;
+            std::vector<bool> sites;
+            std::string defs;
+            std::string record;
+            // Renders LogTraits types, their format ids mean nothing to another process.
+            LineFormatter user_types;
+        };
+
+        struct ReadState
+        {
+            // Interned for the lifetime of the decoder, strings and sites point into it.
+            std::set<std::string> pool;
+            std::vector<char const *> strings;
+            SiteTable sites;
+            uint8_t fraction_digits = 6;
+        };
+
+        static size_t write_header(std::ostream &os, uint8_t fraction_digits)
+        {
+            os.write(binary_log_magic, sizeof(binary_log_magic));
+            os.put(static_cast<char>(fraction_digits));
+            return sizeof(binary_log_magic) + 1;
+        }
+
+        static size_t write(LLogLine &logline, uint64_t nanoseconds, std::ostream &os, WriteState &state)
+        {
+            std::string &record = state.record;
+            state.defs.clear();
+            record.clear();
+
+            char *b = data(logline);
+            char const *const end = b + logline.m_bytes_used;
+
+            record.append(reinterpret_cast<char const *>(&nanoseconds), sizeof(uint64_t));
+            b += sizeof(uint64_t);
+            record.append(b, sizeof(std::thread::id));
+            b += sizeof(std::thread::id);
+            uint32_t site_id;
+            memcpy(&site_id, b, sizeof(site_id));
+            define_site(state, site_id);
+            record.append(b, sizeof(uint32_t) + sizeof(LogLevel));
+            b += sizeof(uint32_t) + sizeof(LogLevel);
+
+            while (b < end)
+            {
+                uint8_t const type_id = static_cast<uint8_t>(*b++);
+                record.push_back(static_cast<char>(type_id));
+                if (type_id == TupleIndex<LLogLine::string_literal_t, SupportedTypes>::value || type_id == TupleIndex<LLogLine::field_name_t, SupportedTypes>::value)
+                {
+                    // Both hold just the pointer.
+                    uint32_t const id = string_id(state, load<LLogLine::string_literal_t>(b).m_s);
+                    record.append(reinterpret_cast<char const *>(&id), sizeof(id));
+                    b += sizeof(LLogLine::string_literal_t);
+                    continue;
+                }
+                if (type_id == TupleIndex<LLogLine::user_type_t, SupportedTypes>::value)
+                {
+                    state.user_types.clear();
+                    decode<LLogLine::user_type_t>(state.user_types, b);
+                    b += argument_size(type_id, b);
+                    uint32_t const size = static_cast<uint32_t>(state.user_types.size());
+                    record.back() = static_cast<char>(TupleIndex<LLogLine::sized_string_t, SupportedTypes>::value);
+                    record.append(reinterpret_cast<char const *>(&size), sizeof(size));
+                    record.append(state.user_types.data(), size);
+                    continue;
+                }
+                size_t const length = argument_size(type_id, b);
+                record.append(b, length);
+                b += length;
+            }
+
+            os.write(state.defs.data(), state.defs.size());
+            char frame[1 + sizeof(uint32_t)] = {'R'};
+            uint32_t const length = static_cast<uint32_t>(record.size());
+            memcpy(frame + 1, &length, sizeof(length));
+            os.write(frame, sizeof(frame));
+            os.write(record.data(), record.size());
+            return state.defs.size() + sizeof(frame) + record.size();
+        }
+
+        enum class ReadResult
+        {
+            RECORD,
+            END,
+            CORRUPT
+        };
+
+        // Reads frames up to and including the next record, which is rebuilt in logline.
+        static ReadResult read(std::istream &is, ReadState &state, LLogLine &logline)
+        {
+            std::string payload;
+            while (true)
+            {
+                char frame_type;
+                if (!is.get(frame_type))
+                    return ReadResult::END;
+
+                if (frame_type == binary_log_magic[0])
+                {
+                    char magic[sizeof(binary_log_magic)];
+                    if (!is.read(magic, sizeof(magic)) || memcmp(magic, binary_log_magic + 1, sizeof(magic) - 1) != 0)
+                        return ReadResult::CORRUPT;
+                    state.strings.clear();
+                    state.sites.clear();
+                    state.fraction_digits = magic[sizeof(magic) - 1] == 9 ? 9 : 6;
+                    continue;
+                }
+
+                if (frame_type == 'S')
+                {
+                    uint32_t values[2];
+                    if (!is.read(reinterpret_cast<char *>(values), sizeof(values)) || values[0] != state.strings.size())
+                        return ReadResult::CORRUPT;
+                    payload.resize(values[1]);
+                    if (!is.read(&payload[0], payload.size()))
+                        return ReadResult::CORRUPT;
+                    state.strings.push_back(state.pool.insert(payload).first->c_str());
+                    continue;
+                }
+
+                if (frame_type == 'T')
+                {
+                    uint32_t values[4];
+                    char level;
+                    if (!is.read(reinterpret_cast<char *>(values), sizeof(values)) || !is.get(level) ||
+                        values[1] >= state.strings.size() || values[2] >= state.strings.size() ||
+                        static_cast<uint8_t>(level) > static_cast<uint8_t>(LogLevel::CRIT))
+                        return ReadResult::CORRUPT;
+                    state.sites.add(values[0], state.strings[values[1]], state.strings[values[2]], values[3], static_cast<LogLevel>(level));
+                    continue;
+                }
+
+                uint32_t length;
+                if (frame_type != 'R' || !is.read(reinterpret_cast<char *>(&length), sizeof(length)))
+                    return ReadResult::CORRUPT;
+                payload.resize(length);
+                if (!is.read(&payload[0], payload.size()))
+                    return ReadResult::CORRUPT;
+                return rebuild(payload, state, logline) ? ReadResult::RECORD : ReadResult::CORRUPT;
+            }
+        }
+
+        static LogLevel level(LLogLine &logline)
+        {
+            return load<LogLevel>(data(logline) + header_size - sizeof(LogLevel));
+        }
+
+        static std::thread::id thread(LLogLine &logline)
+        {
+            std::thread::id id;
+            memcpy(&id, data(logline) + sizeof(uint64_t), sizeof(id));
+            return id;
+        }
+
+        static uint32_t site(LLogLine &logline)
+        {
+            uint32_t site_id;
+            memcpy(&site_id, data(logline) + sizeof(uint64_t) + sizeof(std::thread::id), sizeof(site_id));
+            return site_id;
+        }
+
+    private:
+        static constexpr size_t header_size = sizeof(uint64_t) + sizeof(std::thread::id) + sizeof(uint32_t) + sizeof(LogLevel);
+
+        static char *data(LLogLine &logline)
+        {
+            return !logline.m_heap_buffer ? logline.m_stack_buffer : logline.m_heap_buffer.get();
+        }
+
+        static size_t argument_size(uint8_t type_id, char const *b)
+        {
+            switch (type_id)
+            {
+            case TupleIndex<char, SupportedTypes>::value:
+            case TupleIndex<bool, SupportedTypes>::value:
+            case TupleIndex<int8_t, SupportedTypes>::value:
+            case TupleIndex<uint8_t, SupportedTypes>::value:
+                return sizeof(char);
+            case TupleIndex<int16_t, SupportedTypes>::value:
+            case TupleIndex<uint16_t, SupportedTypes>::value:
+                return sizeof(uint16_t);
+            case TupleIndex<float, SupportedTypes>::value:
+                return sizeof(float);
+            case TupleIndex<void const *, SupportedTypes>::value:
+                return sizeof(void const *);
+            case TupleIndex<LLogLine::sized_string_t, SupportedTypes>::value:
+            case TupleIndex<LLogLine::hex_dump_t, SupportedTypes>::value:
+            {
+                uint32_t length;
+                memcpy(&length, b, sizeof(length));
+                return sizeof(length) + length;
+            }
+            case TupleIndex<LLogLine::user_type_t, SupportedTypes>::value:
+            {
+                uint32_t length;
+                memcpy(&length, b + sizeof(uint32_t), sizeof(length));
+                return 2 * sizeof(uint32_t) + length;
+            }
+            case TupleIndex<uint32_t, SupportedTypes>::value:
+            case TupleIndex<int32_t, SupportedTypes>::value:
+                return sizeof(uint32_t);
+            case TupleIndex<uint64_t, SupportedTypes>::value:
+            case TupleIndex<int64_t, SupportedTypes>::value:
+                return sizeof(uint64_t);
+            case TupleIndex<double, SupportedTypes>::value:
+                return sizeof(double);
+            case TupleIndex<char *, SupportedTypes>::value:
+                return strlen(b) + 1;
+            case TupleIndex<LLogLine::string_literal_t, SupportedTypes>::value:
+            case TupleIndex<LLogLine::field_name_t, SupportedTypes>::value:
+                return sizeof(char const *);
+            }
+            return 0;
+        }
+
+        static uint32_t string_id(WriteState &state, char const *s)
+        {
+            auto it = state.string_ids.find(s);
+            if (it != state.string_ids.end())
+                return it->second;
+
+            uint32_t const values[2] = {static_cast<uint32_t>(state.string_ids.size()), static_cast<uint32_t>(s ? strlen(s) : 0)};
+            state.string_ids.emplace(s, values[0]);
+            state.defs.push_back('S');
+            state.defs.append(reinterpret_cast<char const *>(values), sizeof(values));
+            state.defs.append(s ? s : "", values[1]);
+            return values[0];
+        }
+
+        static void define_site(WriteState &state, uint32_t site_id)
+        {
+            if (site_id < state.sites.size() && state.sites[site_id])
+                return;
+            if (site_id >= state.sites.size())
+                state.sites.resize(site_id + 1);
+            state.sites[site_id] = true;
+
+            LogSite const &site = site_registry().get(site_id).site;
+            uint32_t const values[4] = {site_id, string_id(state, site.file), string_id(state, site.function), site.line};
+            state.defs.push_back('T');
+            state.defs.append(reinterpret_cast<char const *>(values), sizeof(values));
+            state.defs.push_back(static_cast<char>(site.level));
+        }
+
+        static bool copy_bytes(char const *&p, char const *end, size_t length, LLogLine &logline)
+        {
+            if (static_cast<size_t>(end - p) < length)
+                return false;
+            logline.resize_buffer_if_needed(length);
+            memcpy(logline.buffer(), p, length);
+            logline.m_bytes_used += length;
+            p += length;
+            return true;
+        }
+
+        static bool read_id(char const *&p, char const *end, uint32_t &id)
+        {
+            if (static_cast<size_t>(end - p) < sizeof(id))
+                return false;
+            memcpy(&id, p, sizeof(id));
+            p += sizeof(id);
+            return true;
+        }
+
+        static bool rebuild(std::string const &payload, ReadState &state, LLogLine &logline)
+        {
+            char const *p = payload.data();
+            char const *const end = p + payload.size();
+
+            logline.m_heap_buffer.reset();
+            logline.m_buffer_size = sizeof(logline.m_stack_buffer);
+            logline.m_bytes_used = 0;
+
+            uint32_t site_id;
+            if (!copy_bytes(p, end, sizeof(uint64_t) + sizeof(std::thread::id), logline) || !read_id(p, end, site_id))
+                return false;
+            if (!state.sites.contains(site_id))
+                return false;
+            logline.encode<uint32_t>(site_id);
+            if (!copy_bytes(p, end, sizeof(LogLevel), logline))
+                return false;
+
+            while (p < end)
+            {
+                uint8_t const type_id = static_cast<uint8_t>(*p);
+                if (!copy_bytes(p, end, 1, logline))
+                    return false;
+                if (type_id == TupleIndex<LLogLine::string_literal_t, SupportedTypes>::value || type_id == TupleIndex<LLogLine::field_name_t, SupportedTypes>::value)
+                {
+                    uint32_t id;
+                    if (!read_id(p, end, id) || id >= state.strings.size())
+                        return false;
+                    logline.resize_buffer_if_needed(sizeof(char const *));
+                    if (type_id == TupleIndex<LLogLine::field_name_t, SupportedTypes>::value)
+                        logline.encode<LLogLine::field_name_t>(LLogLine::field_name_t(state.strings[id]));
+                    else
+                        logline.encode<LLogLine::string_literal_t>(LLogLine::string_literal_t(state.strings[id]));
+                    continue;
+                }
+                // Written pre-rendered, format ids do not leave the process.
+                if (type_id >= std::tuple_size<SupportedTypes>::value || type_id == TupleIndex<LLogLine::user_type_t, SupportedTypes>::value)
+                    return false;
+                bool const sized = type_id == TupleIndex<LLogLine::sized_string_t, SupportedTypes>::value ||
+                                   type_id == TupleIndex<LLogLine::hex_dump_t, SupportedTypes>::value;
+                if (sized && static_cast<size_t>(end - p) < sizeof(uint32_t))
+                    return false;
+                size_t length = type_id == TupleIndex<char *, SupportedTypes>::value
+                                    ? strnlen(p, end - p) + 1
+                                    : argument_size(type_id, p);
+                if (!copy_bytes(p, end, length, logline))
+                    return false;
+            }
+            return true;
+        }
+    };
+
+    constexpr size_t BinaryCodec::header_size;
+
+    bool decode_binary_log(std::istream &is, std::ostream &os, DecodeFilter const &filter, LogFormat format)
+    {
+        BinaryCodec::ReadState state;
+        LLogLine logline(LogLevel::INFO, SiteRegistry::unknown_site);
+        LineFormatter formatter;
+        formatter.set_sites(&state.sites);
+        while (true)
+        {
+            switch (BinaryCodec::read(is, state, logline))
+            {
+            case BinaryCodec::ReadResult::END:
+                return true;
+            case BinaryCodec::ReadResult::CORRUPT:
+                return false;
+            case BinaryCodec::ReadResult::RECORD:
+                break;
+            }
+
+            uint64_t const nanoseconds = logline.timestamp();
+            if (BinaryCodec::level(logline) < filter.min_level ||
+                nanoseconds / 1000 < filter.since || nanoseconds / 1000 > filter.until ||
+                (!filter.file.empty() && strstr(state.sites.get(BinaryCodec::site(logline)).site.file, filter.file.c_str()) == nullptr))
+                continue;
+
+            formatter.clear();
+            formatter.set_fraction_digits(state.fraction_digits);
+            formatter.format(logline, nanoseconds, format == LogFormat::BINARY ? LogFormat::TEXT : format);
+            char const *const line_end = formatter.data() + formatter.size();
+            if (std::search(formatter.data(), line_end, filter.contains.begin(), filter.contains.end()) != line_end)
+                os.write(formatter.data(), formatter.size());
+        }
+    }
+
+    /*
+     * LZ77 block codec in the style of LZ4, small enough to carry along: a block is a run of
+     * sequences, each a token (literal length << 4 | match length - 4), the literals, a u16
+     * little-endian offset back into the output and the match. Lengths of 15 continue in bytes
+     * up to 255. The last sequence has literals only. Matches are found through a hash of the
+     * next four bytes, favouring speed over ratio.
+     */
+    class LzCodec
+    {
+    public:
+        // The compressed size, 0 when it would not be smaller than length. dst holds length bytes.
+        size_t compress(char const *src, size_t length, char *dst)
+        {
+            if (length < 2)
+                return 0;
+            uint8_t const *const in = reinterpret_cast<uint8_t const *>(src);
+            uint8_t *op = reinterpret_cast<uint8_t *>(dst);
+            uint8_t *const op_end = op + length - 1;
+            memset(m_table, 0, sizeof(m_table));
+
+            size_t const match_limit = length > last_literals ? length - last_literals : 0;
+            size_t anchor = 0;
+            size_t ip = 0;
+            while (ip + min_match <= match_limit)
+            {
+                uint32_t const sequence = read32(in + ip);
+                uint32_t &slot = m_table[(sequence * 2654435761u) >> (32 - hash_bits)];
+                // Positions are stored plus one, zero is empty.
+                size_t const candidate = slot;
+                slot = static_cast<uint32_t>(ip + 1);
+                if (candidate == 0 || ip + 1 - candidate > max_offset || read32(in + candidate - 1) != sequence)
+                {
+                    // Steps grow through data that does not compress.
+                    ip += 1 + ((ip - anchor) >> 6);
+                    continue;
+                }
+
+                size_t const match_start = candidate - 1;
+                size_t match_length = min_match;
+                while (ip + match_length < match_limit && in[match_start + match_length] == in[ip + match_length])
+                    ++match_length;
+                if (!put_sequence(op, op_end, in + anchor, ip - anchor, ip - match_start, match_length))
+                    return 0;
+                ip += match_length;
+                anchor = ip;
+            }
+            if (!put_sequence(op, op_end, in + anchor, length - anchor, 0, 0))
+                return 0;
+            return op - reinterpret_cast<uint8_t *>(dst);
+        }
+
+        // False unless src decodes to exactly raw_length bytes.
+        static bool decompress(char const *src, size_t length, char *dst, size_t raw_length)
+        {
+            uint8_t const *ip = reinterpret_cast<uint8_t const *>(src);
+            uint8_t const *const end = ip + length;
+            uint8_t *op = reinterpret_cast<uint8_t *>(dst);
+            uint8_t *const op_end = op + raw_length;
+            while (ip < end)
+            {
+                uint8_t const token = *ip++;
+                size_t literal_length = token >> 4;
+                if (!get_length(ip, end, literal_length) || static_cast<size_t>(end - ip) < literal_length ||
+                    static_cast<size_t>(op_end - op) < literal_length)
+                    return false;
+                memcpy(op, ip, literal_length);
+                ip += literal_length;
+                op += literal_length;
+                if (ip == end)
+                    break;
+
+                if (end - ip < 2)
+                    return false;
+                size_t const offset = ip[0] | (static_cast<size_t>(ip[1]) << 8);
+                ip += 2;
+                size_t match_length = token & 15;
+                if (!get_length(ip, end, match_length))
+                    return false;
+                match_length += min_match;
+                if (offset == 0 || offset > static_cast<size_t>(op - reinterpret_cast<uint8_t *>(dst)) ||
+                    static_cast<size_t>(op_end - op) < match_length)
+                    return false;
+                uint8_t const *match = op - offset;
+                if (offset >= match_length)
+                {
+                    memcpy(op, match, match_length);
+                    op += match_length;
+                }
+                else
+                {
+                    // Overlapping, repeats the last offset bytes.
+                    for (size_t i = 0; i < match_length; ++i)
+                        *op++ = *match++;
+                }
+            }
+            return op == op_end;
+        }
+
+    private:
+        static constexpr size_t min_match = 4;
+        static constexpr size_t last_literals = 5;
+        static constexpr size_t max_offset = 65535;
+        static constexpr uint32_t hash_bits = 14;
+
+        static uint32_t read32(uint8_t const *p)
+        {
+            uint32_t value;
+            memcpy(&value, p, sizeof(value));
+            return value;
+        }
+
+        static uint8_t *put_length(uint8_t *op, size_t length)
+        {
+            if (length < 15)
+                return op;
+            length -= 15;
+            for (; length >= 255; length -= 255)
+                *op++ = 255;
+            *op++ = static_cast<uint8_t>(length);
+            return op;
+        }
+
+        static bool get_length(uint8_t const *&ip, uint8_t const *end, size_t &length)
+        {
+            if (length != 15)
+                return true;
+            uint8_t byte;
+            do
+            {
+                if (ip == end)
+                    return false;
+                byte = *ip++;
+                length += byte;
+            } while (byte == 255);
+            return true;
+        }
+
+        // A match_length of 0 writes the final literals-only sequence.
+        static bool put_sequence(uint8_t *&op, uint8_t *op_end, uint8_t const *literals, size_t literal_length, size_t offset, size_t match_length)
+        {
+            size_t const match_code = match_length != 0 ? match_length - min_match : 0;
+            size_t const worst = 1 + literal_length / 255 + 1 + literal_length + (match_length != 0 ? 2 + match_code / 255 + 1 : 0);
+            if (static_cast<size_t>(op_end - op) < worst)
+                return false;
+            *op++ = static_cast<uint8_t>((std::min<size_t>(literal_length, 15) << 4) | std::min<size_t>(match_code, 15));
+            op = put_length(op, literal_length);
+            memcpy(op, literals, literal_length);
+            op += literal_length;
+            if (match_length == 0)
+                return true;
+            *op++ = static_cast<uint8_t>(offset);
+            *op++ = static_cast<uint8_t>(offset >> 8);
+            op = put_length(op, match_code);
+            return true;
+        }
+
+    private:
+        uint32_t m_table[1 << hash_bits];
+    };
+
+    constexpr size_t LzCodec::min_match;
+    constexpr size_t LzCodec::last_literals;
+    constexpr size_t LzCodec::max_offset;
+
+    /*
+     * Compressed log file: compressed_log_magic, then frames of u32 raw length, u32 stored
+     * length and the stored bytes, LzCodec output or the raw bytes when both lengths are equal.
+     * Frames decode independently and concatenated files are accepted.
+     */
+    char const compressed_log_magic[8] = {'L', 'L', 'O', 'G', 'L', 'Z', 'F', 1};
+    uint32_t const max_frame_length = 1u << 30;
+
+    // Replaces frame with the frame for data, compress false stores it as is.
+    void encode_frame(LzCodec &codec, char const *data, uint32_t length, bool compress, std::vector<char> &frame)
+    {
+        frame.resize(2 * sizeof(uint32_t) + length);
+        size_t stored = compress ? codec.compress(data, length, frame.data() + 2 * sizeof(uint32_t)) : 0;
+        if (stored == 0)
+        {
+            memcpy(frame.data() + 2 * sizeof(uint32_t), data, length);
+            stored = length;
+        }
+        uint32_t const header[2] = {length, static_cast<uint32_t>(stored)};
+        memcpy(frame.data(), header, sizeof(header));
+        frame.resize(sizeof(header) + stored);
+    }
+
+    bool decompress_log(std::istream &is, std::ostream &os)
+    {
+        char magic[sizeof(compressed_log_magic)];
+        if (!is.read(magic, sizeof(magic)) || memcmp(magic, compressed_log_magic, sizeof(magic)) != 0)
+            return false;
+
+        std::vector<char> stored;
+        std::vector<char> raw;
+        while (true)
+        {
+            uint32_t header[2];
+            is.read(reinterpret_cast<char *>(header), sizeof(header));
+            if (is.gcount() == 0)
+                return true;
+            if (is.gcount() != sizeof(header))
+                return false;
+            if (memcmp(header, compressed_log_magic, sizeof(header)) == 0)
+                continue;
+            if (header[0] > max_frame_length || header[1] > header[0])
+                return false;
+
+            stored.resize(header[1]);
+            if (!is.read(stored.data(), header[1]))
+                return false;
+            if (header[1] == header[0])
+            {
+                os.write(stored.data(), header[1]);
+                continue;
+            }
+            raw.resize(header[0]);
+            if (!LzCodec::decompress(stored.data(), header[1], raw.data(), header[0]))
+                return false;
+            os.write(raw.data(), header[0]);
+        }
+    }
+
+    std::atomic<uint32_t> next_counter_shard{0};
+
+    /*
+     * Counter bumped by many producer threads. Each thread increments its own cache line
+     * and readers add the shards up.
+     */
+    class ShardedCounter
+    {
+    public:
+        ShardedCounter()
+        {
+            for (auto &shard : m_shards)
+                shard.value.store(0, std::memory_order_relaxed);
+        }
+
+        void increment()
+        {
+            static thread_local uint32_t const index = next_counter_shard.fetch_add(1, std::memory_order_relaxed) % shard_count;
+            m_shards[index].value.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        uint64_t load() const
+        {
+            uint64_t sum = 0;
+            for (auto const &shard : m_shards)
+                sum += shard.value.load(std::memory_order_relaxed);
+            return sum;
+        }
+
+    private:
+        static constexpr size_t shard_count = 16;
+
+        struct Shard
+        {
+            std::atomic<uint64_t> value;
+            char pad[64 - sizeof(std::atomic<uint64_t>)];
+        };
+
+        char pad[64];
+        Shard m_shards[shard_count];
+    };
+
+    /*
+     * Exact count of the records a buffer lost, plus the time span of the drops that were
+     * not reported in the log yet. Producers only touch it when they lose a record.
+     */
+    class DropTracker
+    {
+    public:
+        DropTracker() : m_unreported(0), m_first(UINT64_MAX), m_last(0) {}
+
+        void record(uint64_t timestamp)
+        {
+            m_total.increment();
+            uint64_t first = m_first.load(std::memory_order_relaxed);
+            while (timestamp < first && !m_first.compare_exchange_weak(first, timestamp, std::memory_order_relaxed))
+                ;
+            uint64_t last = m_last.load(std::memory_order_relaxed);
+            while (timestamp > last && !m_last.compare_exchange_weak(last, timestamp, std::memory_order_relaxed))
+                ;
+            // Published after the span, so a reader that sees the count also sees its timestamps.
+            m_unreported.fetch_add(1, std::memory_order_release);
+        }
+
+        uint64_t total() const
+        {
+            return m_total.load();
+        }
+
+        // Consumer side. Returns the drops since the last call and their span in raw timestamps.
+        uint64_t take_unreported(uint64_t &first, uint64_t &last)
+        {
+            if (m_unreported.load(std::memory_order_relaxed) == 0)
+                return 0;
+            uint64_t const count = m_unreported.exchange(0, std::memory_order_acquire);
+            first = m_first.exchange(UINT64_MAX, std::memory_order_relaxed);
+            last = m_last.exchange(0, std::memory_order_relaxed);
+            if (first > last)
+            {
+                // The span went out with the previous report, the count was published just after it.
+                first = last = timestamp_now();
+            }
+            return count;
+        }
+
+    private:
+        ShardedCounter m_total;
+        std::atomic<uint64_t> m_unreported;
+        std::atomic<uint64_t> m_first;
+        std::atomic<uint64_t> m_last;
+    };
+
+    struct BufferBase
+    {
+        virtual ~BufferBase() = default;
+
+        virtual void push(LLogLine &&logline) = 0;
+        virtual bool try_pop(LLogLine &logline) = 0;
+
+        // Space for an encoded line of length bytes, published with commit(). nullptr where lines only come as LLogLines.
+        virtual char *reserve(size_t)
+        {
+            return nullptr;
+        }
+
+        virtual void commit(char *)
+        {
+        }
+
+        // Queue segments or producer rings currently allocated.
+        virtual size_t segments()
+        {
+            return 1;
+        }
+
+        /*
+         * Consumer side, for buffers that do not hand lines out in the order they were produced.
+         * mark() notes how far every producer got, reached_mark() holds once all of that was popped.
+         */
+        virtual void mark()
+        {
+        }
+
+        virtual bool reached_mark()
+        {
+            return true;
+        }
+
+        DropTracker drops;
+    };
+
+    struct SpinLock
+    {
+        SpinLock(std::atomic_flag &flag) : m_flag(flag)
+        {
+            while (m_flag.test_and_set(std::memory_order_acquire))
+                ;
+        }
+        ~SpinLock()
+        {
+            m_flag.clear(std::memory_order_release);
+        }
+
+    private:
+        std::atomic_flag &m_flag;
+    };
+
+    /*
+     * Bounded multi-producer ring of loglines. Every slot carries a sequence number that says
+     * whether it is free for the producer at a given position or holds the line the consumer
+     * expects there, so a full ring is detected without waiting on the consumer.
+     * What happens to a line that does not fit is decided by the OverflowPolicy.
+     */
+    class RingBuffer : public BufferBase
+    {
+    public:
+        struct alignas(64) Item
+        {
+            Item(uint64_t position)
+                : sequence(position), logline(LogLevel::INFO, SiteRegistry::unknown_site)
+            {
+            }
+
+            std::atomic<uint64_t> sequence;
+            LLogLine logline;
+        };
+
+        RingBuffer(size_t const size, OverflowPolicy policy, uint32_t block_timeout_us)
+            : m_size(size), m_ring(static_cast<Item *>(std::malloc(size * sizeof(Item)))), m_policy(policy),
+              m_block_timeout(std::chrono::microseconds(block_timeout_us)), m_write_index(0), m_read_index(0), m_blocked(0), m_spilled(0)
+        {
+            for (size_t i = 0; i < m_size; i++)
+            {
+                new (&m_ring[i]) Item(i);
+            }
+            static_assert(sizeof(Item) == 256, "Unexpected size != 256");
+        }
+
+        ~RingBuffer()
+        {
+            for (size_t i = 0; i < m_size; i++)
+            {
+                m_ring[i].~Item();
+            }
+            std::free(m_ring);
+        }
+
+        void push(LLogLine &&logline) override
+        {
+            switch (m_policy)
+            {
+            case OverflowPolicy::DROP_OLDEST:
+                while (!try_push(logline))
+                {
+                    // The oldest line is still being written by a slow producer, give up the new one instead.
+                    if (!evict_oldest())
+                    {
+                        drops.record(logline.timestamp());
+                        return;
+                    }
+                }
+                return;
+            case OverflowPolicy::DROP_NEWEST:
+                if (!try_push(logline))
+                    drops.record(logline.timestamp());
+                return;
+            case OverflowPolicy::BLOCK:
+                if (!try_push(logline) && !push_blocking(logline))
+                    drops.record(logline.timestamp());
+                return;
+            case OverflowPolicy::SPILL:
+                // Once anything is spilled, later lines follow it so the consumer sees them in order.
+                if (m_spilled.load(std::memory_order_acquire) != 0 || !try_push(logline))
+                    spill(logline);
+                return;
+            }
+        }
+
+        bool try_pop(LLogLine &logline) override
+        {
+            if (take(&logline))
+            {
+                if (m_policy == OverflowPolicy::BLOCK)
+                    wake_blocked();
+                return true;
+            }
+
+            if (m_spilled.load(std::memory_order_acquire) == 0)
+                return false;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            // Lines that went to the ring before the spill started are older, finish them first.
+            if (take(&logline))
+                return true;
+            logline = std::move(m_spill.front());
+            m_spill.pop_front();
+            m_spilled.store(m_spill.size(), std::memory_order_release);
+            return true;
+        }
+
+        RingBuffer(RingBuffer const &) = delete;
+        RingBuffer &operator=(RingBuffer const &) = delete;
+
+    private:
+        // Moves the line into a free slot, false without touching it when the ring is full.
+        bool try_push(LLogLine &logline)
+        {
+            uint64_t position = m_write_index.load(std::memory_order_relaxed);
+            while (true)
+            {
+                Item &item = m_ring[position % m_size];
+                int64_t const lag = static_cast<int64_t>(item.sequence.load(std::memory_order_acquire) - position);
+                if (lag == 0)
+                {
+                    if (m_write_index.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    {
+                        item.logline = std::move(logline);
+                        item.sequence.store(position + 1, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (lag < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    position = m_write_index.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        // Takes the oldest line, moving it into logline or discarding it when logline is null.
+        bool take(LLogLine *logline)
+        {
+            uint64_t position = m_read_index.load(std::memory_order_relaxed);
+            while (true)
+            {
+                Item &item = m_ring[position % m_size];
+                int64_t const lag = static_cast<int64_t>(item.sequence.load(std::memory_order_acquire) - (position + 1));
+                if (lag == 0)
+                {
+                    // Producers evicting under DROP_OLDEST compete with the consumer for the oldest slot.
+                    if (m_read_index.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+                    {
+                        if (logline != nullptr)
+                            *logline = std::move(item.logline);
+                        else
+                            drops.record(item.logline.timestamp());
+                        item.sequence.store(position + m_size, std::memory_order_release);
+                        return true;
+                    }
+                }
+                else if (lag < 0)
+                {
+                    return false;
+                }
+                else
+                {
+                    position = m_read_index.load(std::memory_order_relaxed);
+                }
+            }
+        }
+
+        bool evict_oldest()
+        {
+            return take(nullptr);
+        }
+
+        bool push_blocking(LLogLine &logline)
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_blocked.fetch_add(1, std::memory_order_seq_cst);
+            bool const pushed = m_space.wait_for(lock, m_block_timeout, [&] { return try_push(logline); });
+            m_blocked.fetch_sub(1, std::memory_order_relaxed);
+            return pushed;
+        }
+
+        void wake_blocked()
+        {
+            // Pairs with the increment in push_blocking, which retries the ring under the mutex.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_blocked.load(std::memory_order_relaxed) != 0)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_space.notify_all();
+            }
+        }
+
+        void spill(LLogLine &logline)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            // The overflow segment is as large as the ring.
+            if (m_spill.size() >= m_size)
+            {
+                drops.record(logline.timestamp());
+                return;
+            }
+            m_spill.push_back(std::move(logline));
+            m_spilled.store(m_spill.size(), std::memory_order_release);
+        }
+
+    private:
+        size_t const m_size;
+        Item *m_ring;
+        OverflowPolicy const m_policy;
+        std::chrono::microseconds const m_block_timeout;
+        char pad0[64];
+        std::atomic<uint64_t> m_write_index;
+        char pad1[64];
+        std::atomic<uint64_t> m_read_index;
+        char pad2[64];
+        std::atomic<uint32_t> m_blocked;
+        std::atomic<size_t> m_spilled;
+        std::mutex m_mutex;
+        std::condition_variable m_space;
+        std::deque<LLogLine> m_spill;
+    };
+
+    class Buffer
+    {
+    public:
+        struct Item
+        {
+            Item(LLogLine &&llogline) : logline(std::move(llogline)) {}
             char padding[256 - sizeof(LLogLine)];
             LLogLine logline;
         };
 
-        static constexpr const size_t size = 32768; //8M
+        static constexpr const size_t size = 32768; //8M
+
+        static constexpr const size_t memory_size = size * sizeof(Item) + (size + 1) * sizeof(std::atomic<unsigned int>);
+
+        Buffer() : m_buffer(static_cast<Item *>(std::malloc(size * sizeof(Item))))
+        {
+            if (m_buffer == nullptr)
+                throw std::bad_alloc();
+            // Fault the pages in now rather than on the producers' first pass.
+            memset(static_cast<void *>(m_buffer), 0, size * sizeof(Item));
+            reset();
+            static_assert(sizeof(Item) == 256, "Unexcepted size != 256");
+        }
+
+        ~Buffer()
+        {
+            for (size_t i = 0; i < size; ++i)
+            {
+                if (m_write_state[i].load(std::memory_order_relaxed))
+                    m_buffer[i].~Item();
+            }
+            std::free(m_buffer);
+        }
+
+        // Consumer side, once every item has been popped.
+        void reset()
+        {
+            for (size_t i = 0; i <= size; ++i)
+            {
+                m_write_state[i].store(0, std::memory_order_relaxed);
+            }
+        }
+
+        bool push(LLogLine &&logline, unsigned int const write_index)
+        {
+            new (&m_buffer[write_index]) Item(std::move(logline));
+            m_write_state[write_index].store(1, std::memory_order_release);
+            return m_write_state[size].fetch_add(1, std::memory_order_acquire) + 1 == size;
+        }
+
+        bool try_pop(LLogLine &logline, unsigned int const read_index)
+        {
+            if (m_write_state[read_index].load(std::memory_order_acquire))
+            {
+                Item &item = m_buffer[read_index];
+                logline = std::move(item.logline);
+                item.~Item();
+                m_write_state[read_index].store(0, std::memory_order_relaxed);
+                return true;
+            }
+            return false;
+        }
+
+        Buffer(Buffer const &) = delete;
+        Buffer &operator=(Buffer const &) = delete;
+
+    private:
+        Item *m_buffer;
+        std::atomic<unsigned int> m_write_state[size + 1];
+    };
+
+    /*
+     * Unbounded-looking queue of Buffer segments backed by a pool of pre-allocated ones.
+     * Drained segments go back to the pool instead of being freed. A new segment is only
+     * allocated while the pool is empty and the memory budget allows it, otherwise the
+     * producer that needs one blocks until the consumer recycles a segment.
+     */
+    class QueueBuffer : public BufferBase
+    {
+    public:
+        QueueBuffer(QueueBuffer const &) = delete;
+        QueueBuffer &operator=(QueueBuffer const &) = delete;
+
+        QueueBuffer(size_t const preallocated_segments, size_t const max_segments)
+            : m_max_segments(std::max(static_cast<size_t>(1), max_segments)), m_segment_count(0), m_pool_size(0), m_pool_waiters(0),
+              m_current_read_buffer{nullptr}, m_write_index(0), m_rotation_waiters(0), m_flag{ATOMIC_FLAG_INIT}, m_read_index(0)
+        {
+            size_t const segments = std::min(std::max(static_cast<size_t>(1), preallocated_segments), m_max_segments);
+            for (size_t i = 0; i < segments; ++i)
+                m_pool.emplace_back(new Buffer());
+            m_segment_count = segments;
+            m_pool_size.store(segments, std::memory_order_relaxed);
+            setup_next_write_buffer();
+        }
+
+        void push(LLogLine &&logline) override
+        {
+            while (true)
+            {
+                unsigned int write_index = m_write_index.fetch_add(1, std::memory_order_acq_rel);
+                if (write_index < Buffer::size)
+                {
+                    if (m_current_write_buffer.load(std::memory_order_acquire)->push(std::move(logline), write_index))
+                    {
+                        setup_next_write_buffer();
+                    }
+                    return;
+                }
+                wait_for_next_write_buffer();
+            }
+        }
+
+        bool try_pop(LLogLine &logline) override
+        {
+            if (m_current_read_buffer == nullptr)
+                m_current_read_buffer = get_next_read_buffer();
+
+            // Producers never allocate, the consumer keeps a spare segment ahead of them.
+            if (!m_at_budget && m_pool_size.load(std::memory_order_relaxed) <= 1)
+                grow_pool();
+
+            Buffer *read_buffer = m_current_read_buffer;
+
+            if (read_buffer == nullptr)
+                return false;
+
+            if (read_buffer->try_pop(logline, m_read_index))
+            {
+                m_read_index++;
+                if (m_read_index == Buffer::size)
+                {
+                    m_read_index = 0;
+                    m_current_read_buffer = nullptr;
+                    std::unique_ptr<Buffer> drained;
+                    {
+                        SpinLock spinlock(m_flag);
+                        drained = std::move(m_buffers.front());
+                        m_buffers.pop();
+                    }
+                    recycle(std::move(drained));
+                }
+                return true;
+            }
+            return false;
+        }
+
+        size_t segments() override
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_segment_count;
+        }
+
+    private:
+        void setup_next_write_buffer()
+        {
+            std::unique_ptr<Buffer> next_write_buffer = take_from_pool();
+            m_current_write_buffer.store(next_write_buffer.get(), std::memory_order_release);
+            {
+                SpinLock spinlock(m_flag);
+                m_buffers.push(std::move(next_write_buffer));
+            }
+            m_write_index.store(0, std::memory_order_release);
+
+            if (m_rotation_waiters.load(std::memory_order_seq_cst) != 0)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_rotated.notify_all();
+            }
+        }
+
+        // Producers that overran the current segment wait here while another one rotates it.
+        void wait_for_next_write_buffer()
+        {
+            for (int i = 0; i < 1024; ++i)
+            {
+                if (m_write_index.load(std::memory_order_acquire) < Buffer::size)
+                    return;
+                cpu_relax();
+            }
+
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_rotation_waiters.fetch_add(1, std::memory_order_seq_cst);
+            m_rotated.wait(lock, [this] { return m_write_index.load(std::memory_order_seq_cst) < Buffer::size; });
+            m_rotation_waiters.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        std::unique_ptr<Buffer> take_from_pool()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            // Woken by the consumer's top-up, or by a recycled segment once at the memory budget.
+            while (m_pool.empty())
+            {
+                ++m_pool_waiters;
+                m_recycled.wait(lock);
+                --m_pool_waiters;
+            }
+            std::unique_ptr<Buffer> buffer = std::move(m_pool.back());
+            m_pool.pop_back();
+            m_pool_size.store(m_pool.size(), std::memory_order_relaxed);
+            return buffer;
+        }
+
+        void recycle(std::unique_ptr<Buffer> buffer)
+        {
+            buffer->reset();
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_pool.push_back(std::move(buffer));
+            m_pool_size.store(m_pool.size(), std::memory_order_relaxed);
+            if (m_pool_waiters != 0)
+                m_recycled.notify_one();
+        }
+
+        // Consumer side. Segments are never freed, so once at the budget this stops checking.
+        void grow_pool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_at_budget = m_segment_count >= m_max_segments;
+                if (m_pool.size() > 1 || m_at_budget)
+                    return;
+                ++m_segment_count;
+            }
+            recycle(std::unique_ptr<Buffer>(new Buffer()));
+        }
+
+        Buffer *get_next_read_buffer()
+        {
+            SpinLock spinlock(m_flag);
+            return m_buffers.empty() ? nullptr : m_buffers.front().get();
+        }
+
+    private:
+        size_t const m_max_segments;
+        std::mutex m_mutex;
+        std::condition_variable m_recycled;
+        std::condition_variable m_rotated;
+        std::vector<std::unique_ptr<Buffer>> m_pool;
+        size_t m_segment_count;
+        std::atomic<size_t> m_pool_size;
+        size_t m_pool_waiters;
+        std::queue<std::unique_ptr<Buffer>> m_buffers;
+        std::atomic<Buffer *> m_current_write_buffer;
+        Buffer *m_current_read_buffer;
+        std::atomic<unsigned int> m_write_index;
+        std::atomic<unsigned int> m_rotation_waiters;
+        std::atomic_flag m_flag;
+        unsigned int m_read_index;
+        bool m_at_budget = false;
+    };
+
+    /*
+     * Wait-free single-producer/single-consumer ring of loglines owned by one producer thread.
+     * Slots are raw storage, a logline is constructed on push and destroyed on pop.
+     */
+    class StagingRing
+    {
+    public:
+        StagingRing(size_t const capacity)
+            : m_mask(capacity - 1), m_ring(static_cast<LLogLine *>(std::malloc(capacity * sizeof(LLogLine)))),
+              m_tail(0), m_cached_head(0), m_head(0), m_cached_tail(0), retired(false), orphaned(false)
+        {
+        }
+
+        ~StagingRing()
+        {
+            while (front() != nullptr)
+                pop_front();
+            std::free(m_ring);
+        }
+
+        // Producer side.
+        bool push(LLogLine &&logline)
+        {
+            size_t const tail = m_tail.load(std::memory_order_relaxed);
+            if (tail - m_cached_head > m_mask)
+            {
+                m_cached_head = m_head.load(std::memory_order_acquire);
+                if (tail - m_cached_head > m_mask)
+                    return false;
+            }
+            new (&m_ring[tail & m_mask]) LLogLine(std::move(logline));
+            m_tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer side.
+        LLogLine *front()
+        {
+            size_t const head = m_head.load(std::memory_order_relaxed);
+            if (head == m_cached_tail)
+            {
+                m_cached_tail = m_tail.load(std::memory_order_acquire);
+                if (head == m_cached_tail)
+                    return nullptr;
+            }
+            return &m_ring[head & m_mask];
+        }
+
+        void pop_front()
+        {
+            size_t const head = m_head.load(std::memory_order_relaxed);
+            m_ring[head & m_mask].~LLogLine();
+            m_head.store(head + 1, std::memory_order_release);
+        }
+
+        // Consumer side, lines pushed and popped so far.
+        size_t pushed() const
+        {
+            return m_tail.load(std::memory_order_acquire);
+        }
+
+        size_t popped() const
+        {
+            return m_head.load(std::memory_order_relaxed);
+        }
+
+        StagingRing(StagingRing const &) = delete;
+        StagingRing &operator=(StagingRing const &) = delete;
+
+    private:
+        size_t const m_mask;
+        LLogLine *m_ring;
+        char pad0[64];
+        std::atomic<size_t> m_tail;
+        size_t m_cached_head;
+        char pad1[64];
+        std::atomic<size_t> m_head;
+        size_t m_cached_tail;
+        char pad2[64];
+
+    public:
+        // Set by the owning thread when it exits, the consumer releases the ring once drained.
+        std::atomic<bool> retired;
+        // Set when the StagingBuffer goes away first, the owning thread then drops its reference.
+        std::atomic<bool> orphaned;
+    };
+
+    /*
+     * The rings this thread has registered, keyed by StagingBuffer instance id.
+     * Destroyed on thread exit, which retires every ring the thread owned.
+     */
+    struct StagingRings
+    {
+        ~StagingRings()
+        {
+            for (auto &entry : rings)
+                entry.second->retired.store(true, std::memory_order_release);
+        }
+
+        std::vector<std::pair<uint64_t, std::shared_ptr<StagingRing>>> rings;
+        uint64_t last_id = 0;
+        StagingRing *last_ring = nullptr;
+    };
+
+    thread_local StagingRings staging_rings;
+
+    std::atomic<uint64_t> staging_buffer_id{0};
+
+    class StagingBuffer : public BufferBase
+    {
+    public:
+        StagingBuffer(size_t const ring_capacity)
+            : m_id(++staging_buffer_id), m_ring_capacity(ring_capacity), m_flag{ATOMIC_FLAG_INIT}, m_has_pending(false), m_ring_count(0)
+        {
+        }
+
+        ~StagingBuffer()
+        {
+            collect_pending_rings();
+            for (auto &ring : m_rings)
+                ring->orphaned.store(true, std::memory_order_release);
+        }
+
+        void push(LLogLine &&logline) override
+        {
+            if (!ring_for_this_thread()->push(std::move(logline)))
+                drops.record(logline.timestamp());
+        }
+
+        bool try_pop(LLogLine &logline) override
+        {
+            if (m_has_pending.load(std::memory_order_acquire))
+                collect_pending_rings();
+
+            StagingRing *oldest = nullptr;
+            uint64_t oldest_timestamp = 0;
+            for (auto it = m_rings.begin(); it != m_rings.end();)
+            {
+                StagingRing *ring = it->get();
+                LLogLine *front = ring->front();
+                if (front == nullptr)
+                {
+                    // retired is published after the thread's last push, so an empty ring stays empty.
+                    if (ring->retired.load(std::memory_order_acquire) && ring->front() == nullptr)
+                    {
+                        it = m_rings.erase(it);
+                        m_ring_count.fetch_sub(1, std::memory_order_relaxed);
+                        continue;
+                    }
+                }
+                else if (oldest == nullptr || front->timestamp() < oldest_timestamp)
+                {
+                    oldest = ring;
+                    oldest_timestamp = front->timestamp();
+                }
+                ++it;
+            }
+
+            if (oldest == nullptr)
+                return false;
+
+            logline = std::move(*oldest->front());
+            oldest->pop_front();
+            return true;
+        }
+
+        size_t segments() override
+        {
+            return m_ring_count.load(std::memory_order_relaxed);
+        }
+
+        // The merge pops across rings by timestamp, so each ring is checked against its own high-water mark.
+        void mark() override
+        {
+            collect_pending_rings();
+            m_marks.clear();
+            for (auto &ring : m_rings)
+                m_marks.emplace_back(ring, ring->pushed());
+        }
+
+        bool reached_mark() override
+        {
+            for (auto const &mark : m_marks)
+            {
+                if (mark.first->popped() < mark.second)
+                    return false;
+            }
+            return true;
+        }
+
+        StagingBuffer(StagingBuffer const &) = delete;
+        StagingBuffer &operator=(StagingBuffer const &) = delete;
+
+    private:
+        StagingRing *ring_for_this_thread()
+        {
+            if (staging_rings.last_id == m_id)
+                return staging_rings.last_ring;
+
+            StagingRing *ring = nullptr;
+            auto &rings = staging_rings.rings;
+            for (auto it = rings.begin(); it != rings.end();)
+            {
+                if (it->first == m_id)
+                    ring = it->second.get();
+                if (it->second->orphaned.load(std::memory_order_acquire))
+                    it = rings.erase(it);
+                else
+                    ++it;
+            }
+
+            if (ring == nullptr)
+            {
+                std::shared_ptr<StagingRing> new_ring(new StagingRing(m_ring_capacity));
+                ring = new_ring.get();
+                rings.emplace_back(m_id, new_ring);
+                m_ring_count.fetch_add(1, std::memory_order_relaxed);
+                SpinLock spinlock(m_flag);
+                m_pending.push_back(std::move(new_ring));
+                m_has_pending.store(true, std::memory_order_release);
+            }
+
+            staging_rings.last_id = m_id;
+            staging_rings.last_ring = ring;
+            return ring;
+        }
+
+        void collect_pending_rings()
+        {
+            SpinLock spinlock(m_flag);
+            for (auto &ring : m_pending)
+                m_rings.push_back(std::move(ring));
+            m_pending.clear();
+            m_has_pending.store(false, std::memory_order_relaxed);
+        }
+
+    private:
+        uint64_t const m_id;
+        size_t const m_ring_capacity;
+        std::atomic_flag m_flag;
+        std::atomic<bool> m_has_pending;
+        std::atomic<size_t> m_ring_count;
+        std::vector<std::shared_ptr<StagingRing>> m_pending;
+        std::vector<std::shared_ptr<StagingRing>> m_rings;
+        std::vector<std::pair<std::shared_ptr<StagingRing>, size_t>> m_marks;
+    };
+
+    /*
+     * Multi-producer byte ring holding variable-length records back to back.
+     * A record is an 8 byte header followed by the encoded logline, padded to 8 bytes.
+     * Producers claim space with reserve() and publish it with commit(), the consumer
+     * copies records out in reservation order and zeroes the space it releases.
+     * A record that does not fit before the end of the ring is preceded by padding.
+     */
+    class ByteRing : public BufferBase
+    {
+    public:
+        ByteRing(size_t const capacity)
+            : m_capacity(capacity), m_mask(capacity - 1), m_ring(static_cast<char *>(std::calloc(capacity, 1))),
+              m_write(0), m_read(0), m_read_local(0)
+        {
+        }
+
+        ~ByteRing()
+        {
+            std::free(m_ring);
+        }
+
+        // Claims space for a payload of length bytes, waiting while the ring is full. nullptr when it can never fit.
+        char *reserve(size_t const length) override
+        {
+            char *payload;
+            while ((payload = try_reserve(length)) == nullptr)
+            {
+                if (record_size(length) > m_capacity)
+                    return nullptr;
+                std::this_thread::yield();
+            }
+            return payload;
+        }
+
+        void commit(char *payload) override
+        {
+            reinterpret_cast<Header *>(payload - sizeof(Header))->state.store(State::COMMITTED, std::memory_order_release);
+        }
+
+        void push(LLogLine &&logline) override
+        {
+            size_t const length = logline.m_bytes_used;
+            char *const payload = reserve(length);
+            if (payload == nullptr)
+            {
+                drops.record(logline.timestamp());
+                return;
+            }
+            memcpy(payload, !logline.m_heap_buffer ? logline.m_stack_buffer : logline.m_heap_buffer.get(), length);
+            commit(payload);
+        }
+
+        bool try_pop(LLogLine &logline) override
+        {
+            while (true)
+            {
+                Header *header = header_at(m_read_local);
+                uint32_t const state = header->state.load(std::memory_order_acquire);
+                if (state == State::EMPTY)
+                    return false;
+
+                size_t const total = record_size(header->length);
+                if (state == State::COMMITTED)
+                {
+                    logline.m_bytes_used = 0;
+                    logline.resize_buffer_if_needed(header->length);
+                    memcpy(logline.buffer(), header + 1, header->length);
+                    logline.m_bytes_used = header->length;
+                }
+
+                // Any 8 byte word of the released space may hold a later header, it must read as EMPTY.
+                memset(reinterpret_cast<char *>(header + 1), 0, total - sizeof(Header));
+                header->length = 0;
+                header->state.store(State::EMPTY, std::memory_order_relaxed);
+                m_read_local += total;
+                m_read.store(m_read_local, std::memory_order_release);
+                if (state == State::COMMITTED)
+                    return true;
+            }
+        }
+
+        ByteRing(ByteRing const &) = delete;
+        ByteRing &operator=(ByteRing const &) = delete;
+
+    private:
+        struct State
+        {
+            enum : uint32_t
+            {
+                EMPTY,
+                COMMITTED,
+                PADDING
+            };
+        };
+
+        struct Header
+        {
+            std::atomic<uint32_t> state;
+            uint32_t length;
+        };
+
+        static size_t record_size(size_t length)
+        {
+            return (sizeof(Header) + length + 7) & ~static_cast<size_t>(7);
+        }
+
+        Header *header_at(uint64_t position)
+        {
+            return reinterpret_cast<Header *>(m_ring + (position & m_mask));
+        }
+
+        // nullptr when the ring is full or the payload can never fit.
+        char *try_reserve(size_t const length)
+        {
+            size_t const total = record_size(length);
+            while (true)
+            {
+                uint64_t const write = m_write.load(std::memory_order_relaxed);
+                size_t const contiguous = m_capacity - (write & m_mask);
+                size_t const padding = total > contiguous ? contiguous : 0;
+                if (total > m_capacity)
+                    return nullptr;
+
+                // Too big for what is left of this lap and the next together, skip to the start first.
+                size_t const claim = padding + total > m_capacity ? padding : padding + total;
+                if (write + claim - m_read.load(std::memory_order_acquire) > m_capacity)
+                    return nullptr;
+
+                uint64_t expected = write;
+                if (!m_write.compare_exchange_weak(expected, write + claim, std::memory_order_relaxed))
+                    continue;
+
+                if (padding != 0)
+                {
+                    Header *header = header_at(write);
+                    header->length = static_cast<uint32_t>(padding - sizeof(Header));
+                    header->state.store(State::PADDING, std::memory_order_release);
+                    if (claim == padding)
+                        continue;
+                }
+
+                Header *header = header_at(write + padding);
+                header->length = static_cast<uint32_t>(length);
+                return reinterpret_cast<char *>(header + 1);
+            }
+        }
+
+    private:
+        size_t const m_capacity;
+        size_t const m_mask;
+        char *m_ring;
+        char pad0[64];
+        std::atomic<uint64_t> m_write;
+        char pad1[64];
+        std::atomic<uint64_t> m_read;
+        char pad2[64];
+        uint64_t m_read_local;
+    };
+
+#ifdef LLOG_HAS_IO_URING
+    /*
+     * The part of io_uring LogFile needs, over the raw syscalls: queue a write at an offset and
+     * reap completions. Used by the writer thread only.
+     */
+    class IoUring
+    {
+    public:
+        // nullptr when the kernel has no io_uring or it is disabled.
+        static IoUring *create(unsigned const entries)
+        {
+            io_uring_params params;
+            memset(&params, 0, sizeof(params));
+            int const fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+            if (fd < 0)
+                return nullptr;
+            std::unique_ptr<IoUring> ring(new IoUring(fd));
+            if (!ring->map(params))
+                return nullptr;
+            return ring.release();
+        }
+
+        ~IoUring()
+        {
+            if (m_sqes != MAP_FAILED)
+                munmap(m_sqes, m_sqes_size);
+            if (m_cq_ring != MAP_FAILED && m_cq_ring != m_sq_ring)
+                munmap(m_cq_ring, m_cq_ring_size);
+            if (m_sq_ring != MAP_FAILED)
+                munmap(m_sq_ring, m_sq_ring_size);
+            ::close(m_fd);
+        }
+
+        /*
+         * Queues and submits one write, the caller keeps no more than entries in flight.
+         * On false the entry was taken back, no completion will arrive for it.
+         */
+        bool write(int fd, iovec const *iov, uint64_t offset, uint64_t user_data)
+        {
+            unsigned const tail = m_sq_tail->load(std::memory_order_relaxed);
+            unsigned const index = tail & m_sq_mask;
+            io_uring_sqe &sqe = m_sqes[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_WRITEV;
+            sqe.fd = fd;
+            sqe.off = offset;
+            sqe.addr = reinterpret_cast<uint64_t>(iov);
+            sqe.len = 1;
+            sqe.user_data = user_data;
+            m_sq_array[index] = index;
+            m_sq_tail->store(tail + 1, std::memory_order_release);
+            int submitted;
+            do
+                submitted = enter(1, 0, 0);
+            while (submitted < 0 && errno == EINTR);
+            // Without SQPOLL the kernel only reads the queue inside enter, so an entry it did not consume can be withdrawn.
+            if (submitted != 1 && m_sq_head->load(std::memory_order_acquire) == tail)
+            {
+                m_sq_tail->store(tail, std::memory_order_release);
+                return false;
+            }
+            return true;
+        }
+
+        // Blocks for the next completion.
+        bool wait(uint64_t &user_data, int32_t &result)
+        {
+            while (true)
+            {
+                unsigned const head = m_cq_head->load(std::memory_order_relaxed);
+                if (head != m_cq_tail->load(std::memory_order_acquire))
+                {
+                    io_uring_cqe const &cqe = m_cqes[head & m_cq_mask];
+                    user_data = cqe.user_data;
+                    result = cqe.res;
+                    m_cq_head->store(head + 1, std::memory_order_release);
+                    return true;
+                }
+                if (enter(0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+                    return false;
+            }
+        }
+
+        IoUring(IoUring const &) = delete;
+        IoUring &operator=(IoUring const &) = delete;
+
+    private:
+        explicit IoUring(int fd)
+            : m_fd(fd), m_sq_ring(MAP_FAILED), m_cq_ring(MAP_FAILED), m_sqes(static_cast<io_uring_sqe *>(MAP_FAILED)),
+              m_sq_ring_size(0), m_cq_ring_size(0), m_sqes_size(0)
+        {
+        }
+
+        bool map(io_uring_params const &params)
+        {
+            m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool const single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+            if (single)
+                m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+
+            m_sq_ring = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+            if (m_sq_ring == MAP_FAILED)
+                return false;
+            m_cq_ring = single ? m_sq_ring : mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+            if (m_cq_ring == MAP_FAILED)
+                return false;
+            m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+            m_sqes = static_cast<io_uring_sqe *>(mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+            if (m_sqes == MAP_FAILED)
+                return false;
+
+            char *const sq = static_cast<char *>(m_sq_ring);
+            char *const cq = static_cast<char *>(m_cq_ring);
+            m_sq_head = reinterpret_cast<std::atomic<unsigned> *>(sq + params.sq_off.head);
+            m_sq_tail = reinterpret_cast<std::atomic<unsigned> *>(sq + params.sq_off.tail);
+            m_sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+            m_sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+            m_cq_head = reinterpret_cast<std::atomic<unsigned> *>(cq + params.cq_off.head);
+            m_cq_tail = reinterpret_cast<std::atomic<unsigned> *>(cq + params.cq_off.tail);
+            m_cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+            m_cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+            return true;
+        }
+
+        int enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+        {
+            return static_cast<int>(syscall(__NR_io_uring_enter, m_fd, to_submit, min_complete, flags, nullptr, 0));
+        }
+
+    private:
+        int const m_fd;
+        void *m_sq_ring;
+        void *m_cq_ring;
+        io_uring_sqe *m_sqes;
+        size_t m_sq_ring_size;
+        size_t m_cq_ring_size;
+        size_t m_sqes_size;
+        std::atomic<unsigned> *m_sq_head;
+        std::atomic<unsigned> *m_sq_tail;
+        unsigned m_sq_mask;
+        unsigned *m_sq_array;
+        std::atomic<unsigned> *m_cq_head;
+        std::atomic<unsigned> *m_cq_tail;
+        unsigned m_cq_mask;
+        io_uring_cqe *m_cqes;
+    };
+#else
+    class IoUring
+    {
+    public:
+        static IoUring *create(unsigned)
+        {
+            return nullptr;
+        }
+
+        bool write(int, iovec const *, uint64_t, uint64_t)
+        {
+            return false;
+        }
+
+        bool wait(uint64_t &, int32_t &)
+        {
+            return false;
+        }
+    };
+#endif
+
+    /*
+     * Output file that collects formatted records in large aligned blocks. Buffered I/O hands a
+     * block to the kernel with a single write(), or writev() when a record does not fit.
+     * With io_uring the file is opened O_DIRECT and preallocated, full blocks are queued at
+     * their offsets while filling continues in the next one, a flush writes the partial block
+     * padded to the alignment and rewrites it once it holds more, and close trims the file
+     * to the bytes logged. STREAMING compression turns every block into a frame before the
+     * write and stores it raw while over its CPU budget. Bytes are counted here, as they
+     * land in the file, so rolling never has to ask the stream for its position.
+     */
+    class LogFile : public std::streambuf
+    {
+    public:
+        LogFile(size_t const block_size, IoBackend const backend, uint32_t const queue_depth, uint64_t const preallocate_bytes,
+                Compression const compression, uint32_t const cpu_percent)
+            : m_fd(-1), m_block(nullptr), m_block_size(block_size), m_flushed_bytes(0),
+              m_ring(backend == IoBackend::IO_URING && compression != Compression::STREAMING ? IoUring::create(std::max(1u, queue_depth)) : nullptr),
+              m_preallocate_bytes(preallocate_bytes), m_current(0), m_submitted(0), m_in_flight(0),
+              m_codec(compression == Compression::STREAMING ? new LzCodec() : nullptr),
+              m_window_budget(static_cast<uint64_t>(std::min(100u, cpu_percent)) * 10000000), m_window_start(0), m_window_spent(0)
+        {
+            size_t const blocks = m_ring ? std::max(1u, queue_depth) : 1;
+            if (m_ring)
+                m_block_size = (m_block_size + alignment - 1) & ~(alignment - 1);
+            m_slots.resize(blocks);
+            for (Slot &slot : m_slots)
+            {
+                void *block = nullptr;
+                if (posix_memalign(&block, alignment, m_block_size) != 0)
+                {
+                    release();
+                    throw std::bad_alloc();
+                }
+                slot.block = static_cast<char *>(block);
+            }
+            m_block = m_slots[0].block;
+            setp(m_block, m_block + m_block_size);
+        }
+
+        ~LogFile()
+        {
+            close();
+            release();
+        }
+
+        void open(std::string const &path)
+        {
+            close();
+            attach(create(path));
+        }
+
+        void close()
+        {
+            uint64_t const length = bytes_written();
+            finish(detach(), length, false);
+        }
+
+        // Opens, and for io_uring preallocates, a file for attach(). Safe on any thread.
+        int create(std::string const &path) const
+        {
+            int const flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+            int fd = m_ring ? ::open(path.c_str(), flags | O_DIRECT, 0644) : -1;
+            // tmpfs and some network filesystems refuse O_DIRECT.
+            if (fd == -1)
+                fd = ::open(path.c_str(), flags, 0644);
+            if (m_ring && fd != -1 && m_preallocate_bytes > 0)
+                fallocate(fd, 0, 0, static_cast<off_t>(m_preallocate_bytes));
+            return fd;
+        }
+
+        // Continues at the start of fd, -1 discards until the next attach.
+        void attach(int fd)
+        {
+            m_fd = fd;
+            m_flushed_bytes = 0;
+            m_slots[m_current].offset = 0;
+            if (m_codec)
+            {
+                iovec iov = {const_cast<char *>(compressed_log_magic), sizeof(compressed_log_magic)};
+                write_fully(&iov, 1);
+            }
+        }
+
+        // Writes out everything and hands the file over to finish().
+        int detach()
+        {
+            flush();
+            int const fd = m_fd;
+            m_fd = -1;
+            m_flushed_bytes += pptr() - pbase();
+            m_submitted = 0;
+            setp(m_block, m_block + m_block_size);
+            return fd;
+        }
+
+        // Closes a detached file of length bytes. Safe on any thread.
+        void finish(int fd, uint64_t length, bool sync) const
+        {
+            if (fd == -1)
+                return;
+            if (m_ring)
+            {
+                // Drops the preallocated tail and the padding of the last block.
+                int const trimmed = ftruncate(fd, static_cast<off_t>(length));
+                (void)trimmed;
+            }
+            if (sync)
+                fdatasync(fd);
+            ::close(fd);
+        }
+
+        void flush()
+        {
+            size_t const pending = pptr() - pbase();
+            if (m_ring)
+            {
+                if (pending > m_submitted)
+                {
+                    size_t const padded = (pending + alignment - 1) & ~(alignment - 1);
+                    memset(pptr(), 0, padded - pending);
+                    submit(m_current, padded);
+                    m_submitted = pending;
+                }
+                // The block keeps filling, it must not be under I/O.
+                while (m_in_flight > 0)
+                    reap();
+                return;
+            }
+            if (pending == 0)
+                return;
+            if (m_codec)
+            {
+                write_frame(pending);
+            }
+            else
+            {
+                iovec iov = {m_block, pending};
+                write_fully(&iov, 1);
+            }
+            setp(m_block, m_block + m_block_size);
+        }
+
+        // Writes out the block and waits for the data to reach the device.
+        void sync_data()
+        {
+            flush();
+            if (m_fd != -1)
+                fdatasync(m_fd);
+        }
+
+        bool has_pending() const
+        {
+            return static_cast<size_t>(pptr() - pbase()) > m_submitted;
+        }
+
+        uint64_t bytes_written() const
+        {
+            return m_flushed_bytes + (pptr() - pbase());
+        }
+
+        LogFile(LogFile const &) = delete;
+        LogFile &operator=(LogFile const &) = delete;
+
+    protected:
+        int_type overflow(int_type ch) override
+        {
+            spill();
+            if (!traits_type::eq_int_type(ch, traits_type::eof()))
+            {
+                *pptr() = traits_type::to_char_type(ch);
+                pbump(1);
+            }
+            return traits_type::not_eof(ch);
+        }
+
+        std::streamsize xsputn(char const *s, std::streamsize n) override
+        {
+            size_t length = static_cast<size_t>(n);
+            if (length <= static_cast<size_t>(epptr() - pptr()))
+            {
+                memcpy(pptr(), s, length);
+                pbump(static_cast<int>(length));
+                return n;
+            }
+
+            if (m_ring || m_codec)
+            {
+                // Direct I/O wants whole blocks and frames hold at most one, the record is split across them.
+                while (length > 0)
+                {
+                    if (pptr() == epptr())
+                        spill();
+                    size_t const chunk = std::min(length, static_cast<size_t>(epptr() - pptr()));
+                    memcpy(pptr(), s, chunk);
+                    pbump(static_cast<int>(chunk));
+                    s += chunk;
+                    length -= chunk;
+                }
+                return n;
+            }
+
+            // Block and record leave together.
+            iovec iov[2] = {{m_block, static_cast<size_t>(pptr() - pbase())}, {const_cast<char *>(s), length}};
+            write_fully(iov, 2);
+            setp(m_block, m_block + m_block_size);
+            return n;
+        }
+
+        int sync() override
+        {
+            flush();
+            return 0;
+        }
+
+    private:
+        static size_t const alignment = 4096;
+
+        struct Slot
+        {
+            char *block = nullptr;
+            iovec iov = {nullptr, 0};
+            uint64_t offset = 0;
+            bool in_flight = false;
+        };
+
+        // Makes room once the block is full.
+        void spill()
+        {
+            if (m_ring)
+                advance();
+            else
+                flush();
+        }
+
+        // Queues the full block and moves on to the next one once its previous write is done.
+        void advance()
+        {
+            submit(m_current, m_block_size);
+            m_flushed_bytes += m_block_size;
+            m_current = (m_current + 1) % m_slots.size();
+            while (m_slots[m_current].in_flight)
+                reap();
+            m_slots[m_current].offset = m_flushed_bytes;
+            m_submitted = 0;
+            m_block = m_slots[m_current].block;
+            setp(m_block, m_block + m_block_size);
+        }
+
+        void submit(size_t const index, size_t const length)
+        {
+            Slot &slot = m_slots[index];
+            slot.iov.iov_base = slot.block;
+            slot.iov.iov_len = length;
+            if (m_fd == -1)
+                return;
+            if (m_ring->write(m_fd, &slot.iov, slot.offset, index))
+            {
+                slot.in_flight = true;
+                ++m_in_flight;
+            }
+            else
+            {
+                complete(slot, 0);
+            }
+        }
+
+        void reap()
+        {
+            uint64_t index = 0;
+            int32_t result = 0;
+            if (!m_ring->wait(index, result))
+            {
+                // The ring is unusable, finish everything synchronously.
+                for (Slot &slot : m_slots)
+                {
+                    if (slot.in_flight)
+                        complete(slot, 0);
+                    slot.in_flight = false;
+                }
+                m_in_flight = 0;
+                return;
+            }
+            Slot &slot = m_slots[index];
+            // Already finished by the synchronous fallback above.
+            if (!slot.in_flight)
+                return;
+            slot.in_flight = false;
+            --m_in_flight;
+            if (result < 0 || static_cast<size_t>(result) < slot.iov.iov_len)
+                complete(slot, result);
+        }
+
+        // Writes what the ring did not with pwrite, after a short write or any error, dropping O_DIRECT if the kernel refused it.
+        void complete(Slot &slot, int32_t const result)
+        {
+            size_t done = result > 0 ? static_cast<size_t>(result) : 0;
+            if (result == -EINVAL)
+                fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT);
+            while (done < slot.iov.iov_len)
+            {
+                ssize_t const written = ::pwrite(m_fd, slot.block + done, slot.iov.iov_len - done, static_cast<off_t>(slot.offset + done));
+                if (written < 0 && errno == EINVAL && (fcntl(m_fd, F_GETFL) & O_DIRECT))
+                {
+                    fcntl(m_fd, F_SETFL, fcntl(m_fd, F_GETFL) & ~O_DIRECT);
+                    continue;
+                }
+                if (written < 0 && errno == EINTR)
+                    continue;
+                if (written <= 0)
+                    return;
+                done += written;
+            }
+        }
+
+        // Compresses while the last second's compression time is within the budget.
+        void write_frame(size_t const length)
+        {
+            uint64_t const begin = thread_cpu_nanoseconds();
+            uint64_t const now = monotonic_raw_nanoseconds();
+            if (now - m_window_start >= 1000000000)
+            {
+                m_window_start = now;
+                m_window_spent = 0;
+            }
+            bool const compress = m_window_spent < m_window_budget;
+            encode_frame(*m_codec, m_block, static_cast<uint32_t>(length), compress, m_frame);
+            if (compress)
+                m_window_spent += thread_cpu_nanoseconds() - begin;
+            iovec iov = {m_frame.data(), m_frame.size()};
+            write_fully(&iov, 1);
+        }
+
+        void release()
+        {
+            for (Slot &slot : m_slots)
+                std::free(slot.block);
+            m_slots.clear();
+        }
+
+        void write_fully(iovec *iov, int iovcnt)
+        {
+            for (int i = 0; i < iovcnt; ++i)
+                m_flushed_bytes += iov[i].iov_len;
+
+            if (m_fd == -1)
+                return;
+
+            while (iovcnt > 0)
+            {
+                ssize_t written = ::writev(m_fd, iov, iovcnt);
+                if (written < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    return;
+                }
+                while (iovcnt > 0 && static_cast<size_t>(written) >= iov->iov_len)
+                {
+                    written -= iov->iov_len;
+                    ++iov;
+                    --iovcnt;
+                }
+                if (iovcnt > 0)
+                {
+                    iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+                    iov->iov_len -= written;
+                }
+            }
+        }
+
+    private:
+        int m_fd;
+        char *m_block;
+        size_t m_block_size;
+        uint64_t m_flushed_bytes;
+        std::unique_ptr<IoUring> m_ring;
+        uint64_t const m_preallocate_bytes;
+        std::vector<Slot> m_slots;
+        size_t m_current;
+        // Bytes of the current block already on disk from a flush, padded.
+        size_t m_submitted;
+        size_t m_in_flight;
+        std::unique_ptr<LzCodec> m_codec;
+        std::vector<char> m_frame;
+        uint64_t const m_window_budget;
+        uint64_t m_window_start;
+        uint64_t m_window_spent;
+    };
+
+    bool write_fully(int fd, char const *data, size_t length)
+    {
+        while (length > 0)
+        {
+            ssize_t const written = ::write(fd, data, length);
+            if (written < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += written;
+            length -= written;
+        }
+        return true;
+    }
+
+    class StderrSink : public Sink
+    {
+    public:
+        StderrSink(LogLevel min_level) : Sink(min_level, LogFormat::TEXT) {}
+
+        bool write(char const *data, size_t length, LogLevel) override
+        {
+            return write_fully(STDERR_FILENO, data, length);
+        }
+    };
+
+    class UnixSocketSink : public Sink
+    {
+    public:
+        UnixSocketSink(std::string const &path, LogLevel min_level, LogFormat format)
+            : Sink(min_level, format), m_path(path), m_fd(-1)
+        {
+        }
+
+        ~UnixSocketSink()
+        {
+            disconnect();
+        }
+
+        bool write(char const *data, size_t length, LogLevel) override
+        {
+            if (m_fd == -1 && !connect())
+                return false;
+
+            while (length > 0)
+            {
+                ssize_t const sent = ::send(m_fd, data, length, MSG_NOSIGNAL);
+                if (sent < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    // Also a send timeout, a partial record would corrupt the stream.
+                    disconnect();
+                    return false;
+                }
+                data += sent;
+                length -= sent;
+            }
+            return true;
+        }
+
+    private:
+        bool connect()
+        {
+            auto const now = std::chrono::steady_clock::now();
+            if (m_attempted && now - m_last_attempt < std::chrono::seconds(1))
+                return false;
+            m_attempted = true;
+            m_last_attempt = now;
+
+            sockaddr_un address;
+            memset(&address, 0, sizeof(address));
+            address.sun_family = AF_UNIX;
+            if (m_path.size() >= sizeof(address.sun_path))
+                return false;
+            memcpy(address.sun_path, m_path.c_str(), m_path.size());
+
+            m_fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (m_fd == -1)
+                return false;
+            // A stuck collector must not stall the background thread for long.
+            timeval timeout = {0, 100000};
+            setsockopt(m_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            if (::connect(m_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+            {
+                disconnect();
+                return false;
+            }
+            return true;
+        }
+
+        void disconnect()
+        {
+            if (m_fd != -1)
+                ::close(m_fd);
+            m_fd = -1;
+        }
+
+    private:
+        std::string const m_path;
+        int m_fd;
+        bool m_attempted = false;
+        std::chrono::steady_clock::time_point m_last_attempt;
+    };
+
+    std::shared_ptr<Sink> make_stderr_sink(LogLevel min_level)
+    {
+        return std::make_shared<StderrSink>(min_level);
+    }
+
+    std::shared_ptr<Sink> make_unix_socket_sink(std::string const &path, LogLevel min_level, LogFormat format)
+    {
+        return std::make_shared<UnixSocketSink>(path, min_level, format);
+    }
+
+    /*
+     * Flight recorder file layout, all integers native endian:
+     *   header page     flight_recorder_magic, offsets and sizes, clock calibration, write position
+     *   site table      entries u32 id, u32 line, u8 level, u8 0, u16 file length, u16 function length,
+     *                   u16 0, then both names, padded to 8 bytes
+     *   data ring       records u32 length, u32 check, u64 position, then the payload, padded to 8 bytes
+ * Every producer thread claims a chunk of the ring at a time and fills it with its own records,
+ * so records are ordered per thread only and recovery sorts them by timestamp.
+     * A payload is the encoded logline with every string_literal_t copied inline as a char * argument,
+     * every field_name_t as a " key=" char * argument and every LogTraits type as a hex dump.
+     * position is the record's absolute offset in the ring and is stored last, so a record is valid
+     * when it matches where the record was found and check agrees with it.
+     */
+    char const flight_recorder_magic[8] = {'L', 'L', 'O', 'G', 'F', 'R', 'C', 3};
+
+    // The part of the ring this thread claimed from each FlightRecorder, keyed by recorder id.
+    struct RecorderChunk
+    {
+        uint64_t id;
+        uint64_t next;
+        uint64_t end;
+    };
+
+    thread_local std::vector<RecorderChunk> recorder_chunks;
+
+    std::atomic<uint64_t> flight_recorder_id{0};
+
+    class FlightRecorder : public SiteRegistry::Listener
+    {
+    public:
+        struct Header
+        {
+            char magic[8];
+            uint64_t sites_offset;
+            uint64_t sites_size;
+            uint64_t data_offset;
+            uint64_t data_size;
+            uint8_t timestamp_kind;
+            uint8_t fraction_digits;
+            uint16_t reserved;
+            uint32_t pid;
+            // Odd while the calibration below is being updated.
+            std::atomic<uint64_t> calibration_sequence;
+            uint64_t anchor_raw;
+            uint64_t anchor_ns;
+            double ns_per_tick;
+            std::atomic<uint64_t> write;
+            std::atomic<uint64_t> site_bytes;
+        };
+
+        // nullptr when the options do not ask for a recorder or the file cannot be mapped.
+        static FlightRecorder *open(LoggerOptions const &options)
+        {
+            if (options.flight_recorder_path.empty())
+                return nullptr;
+
+            size_t const bytes = static_cast<size_t>(std::max(64u, options.flight_recorder_size_kb)) * 1024;
+            size_t data_size = 64 * 1024;
+            while (data_size * 2 <= bytes)
+                data_size *= 2;
+            size_t const region_size = header_page + sites_size + data_size;
+
+            int const fd = ::open(options.flight_recorder_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd == -1)
+                return nullptr;
+            void *region = MAP_FAILED;
+            if (ftruncate(fd, static_cast<off_t>(region_size)) == 0)
+                region = mmap(nullptr, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (region == MAP_FAILED)
+            {
+                unlink(options.flight_recorder_path.c_str());
+                return nullptr;
+            }
+            return new FlightRecorder(options, static_cast<char *>(region), region_size, data_size);
+        }
+
+        ~FlightRecorder()
+        {
+            site_registry().unsubscribe(this);
+            FlightRecorder *self = this;
+            crash_recorder.compare_exchange_strong(self, nullptr);
+            munmap(m_region, m_region_size);
+            // Everything made it to the log, nothing to recover.
+            unlink(m_path.c_str());
+        }
+
+        // Producer side, a copy into shared memory and no syscall.
+        void record(LLogLine &logline)
+        {
+            char const *const begin = BinaryCodec::data(logline);
+            char const *const end = begin + logline.m_bytes_used;
+
+            size_t length = BinaryCodec::header_size;
+            for (char const *b = begin + BinaryCodec::header_size; b < end;)
+            {
+                uint8_t const type_id = static_cast<uint8_t>(*b++);
+                if (type_id == TupleIndex<LLogLine::string_literal_t, SupportedTypes>::value)
+                {
+                    length += 1 + strlen(load<LLogLine::string_literal_t>(b).m_s) + 1;
+                    b += sizeof(LLogLine::string_literal_t);
+                    continue;
+                }
+                if (type_id == TupleIndex<LLogLine::field_name_t, SupportedTypes>::value)
+                {
+                    length += 1 + 1 + strlen(load<LLogLine::field_name_t>(b).m_s) + 2;
+                    b += sizeof(LLogLine::field_name_t);
+                    continue;
+                }
+                size_t const size = BinaryCodec::argument_size(type_id, b);
+                // A LogTraits type loses its format id and becomes a hex dump.
+                length += 1 + size - (type_id == TupleIndex<LLogLine::user_type_t, SupportedTypes>::value ? sizeof(uint32_t) : 0);
+                b += size;
+            }
+
+            size_t const total = record_size(length);
+            if (total > m_data_size / 2)
+                return;
+
+            uint64_t const position = reserve(total);
+            uint32_t const words[2] = {static_cast<uint32_t>(length), check(position, static_cast<uint32_t>(length))};
+            memcpy(m_data + (position & m_mask), words, sizeof(words));
+
+            uint64_t at = position + record_header_size;
+            copy_in(at, begin, BinaryCodec::header_size);
+            for (char const *b = begin + BinaryCodec::header_size; b < end;)
+            {
+                uint8_t const type_id = static_cast<uint8_t>(*b++);
+                if (type_id == TupleIndex<LLogLine::string_literal_t, SupportedTypes>::value)
+                {
+                    char const *s = load<LLogLine::string_literal_t>(b).m_s;
+                    char const inline_type = static_cast<char>(TupleIndex<char *, SupportedTypes>::value);
+                    copy_in(at, &inline_type, 1);
+                    copy_in(at, s, strlen(s) + 1);
+                    b += sizeof(LLogLine::string_literal_t);
+                    continue;
+                }
+                if (type_id == TupleIndex<LLogLine::field_name_t, SupportedTypes>::value)
+                {
+                    // Recovery only prints TEXT, so the field name goes in as its " key=" rendering.
+                    char const *key = load<LLogLine::field_name_t>(b).m_s;
+                    char const prefix[2] = {static_cast<char>(TupleIndex<char *, SupportedTypes>::value), ' '};
+                    copy_in(at, prefix, sizeof(prefix));
+                    copy_in(at, key, strlen(key));
+                    copy_in(at, "=", 2);
+                    b += sizeof(LLogLine::field_name_t);
+                    continue;
+                }
+                size_t const size = BinaryCodec::argument_size(type_id, b);
+                if (type_id == TupleIndex<LLogLine::user_type_t, SupportedTypes>::value)
+                {
+                    char const hex_type = static_cast<char>(TupleIndex<LLogLine::hex_dump_t, SupportedTypes>::value);
+                    copy_in(at, &hex_type, 1);
+                    copy_in(at, b + sizeof(uint32_t), size - sizeof(uint32_t));
+                }
+                else
+                {
+                    copy_in(at, b - 1, 1 + size);
+                }
+                b += size;
+            }
+
+            reinterpret_cast<std::atomic<uint64_t> *>(m_data + ((position + sizeof(words)) & m_mask))->store(position, std::memory_order_release);
+        }
+
+        // Consumer side when idle, keeps the stored clock mapping close to the wall clock.
+        void refresh_calibration()
+        {
+            if (m_converter.kind() == TimestampKind::SYSTEM_MICROSECONDS)
+                return;
+            m_converter.to_nanoseconds(timestamp_now());
+            uint64_t anchor_raw, anchor_ns;
+            double ns_per_tick;
+            m_converter.anchor(anchor_raw, anchor_ns, ns_per_tick);
+            if (anchor_raw != m_header->anchor_raw)
+                publish_calibration(anchor_raw, anchor_ns, ns_per_tick);
+        }
+
+        // Async-signal-safe, copies the mapped file to the dump path.
+        void dump()
+        {
+            int const fd = ::open(m_dump_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd == -1)
+                return;
+            bool const written = write_fully(fd, m_region, m_region_size);
+            ::close(fd);
+            if (written)
+            {
+                static char const message[] = "llog: flight recorder dumped to ";
+                write_fully(STDERR_FILENO, message, sizeof(message) - 1);
+                write_fully(STDERR_FILENO, m_dump_path.c_str(), m_dump_path.size());
+                write_fully(STDERR_FILENO, "\n", 1);
+            }
+        }
+
+        static bool recover(std::string const &region, std::ostream &os);
+
+        FlightRecorder(FlightRecorder const &) = delete;
+        FlightRecorder &operator=(FlightRecorder const &) = delete;
+
+    private:
+        static constexpr size_t header_page = 4096;
+        static constexpr size_t sites_size = 256 * 1024;
+        static constexpr size_t record_header_size = 2 * sizeof(uint32_t) + sizeof(uint64_t);
+        static constexpr size_t site_entry_size = 2 * sizeof(uint32_t) + 2 * sizeof(uint8_t) + 3 * sizeof(uint16_t);
+        static constexpr size_t max_chunk_size = 4096;
+
+        FlightRecorder(LoggerOptions const &options, char *region, size_t region_size, size_t data_size)
+            : m_id(++flight_recorder_id), m_path(options.flight_recorder_path), m_dump_path(options.flight_recorder_dump_path), m_region(region),
+              m_region_size(region_size), m_header(reinterpret_cast<Header *>(region)), m_sites(region + header_page),
+              m_data(region + header_page + sites_size), m_data_size(data_size), m_mask(data_size - 1),
+              m_chunk_size(std::min(max_chunk_size, data_size / 16)), m_sites_full(false)
+        {
+            static_assert(sizeof(Header) <= header_page, "Header does not fit its page");
+            memcpy(m_header->magic, flight_recorder_magic, sizeof(flight_recorder_magic));
+            m_header->sites_offset = header_page;
+            m_header->sites_size = sites_size;
+            m_header->data_offset = header_page + sites_size;
+            m_header->data_size = data_size;
+            m_header->timestamp_kind = static_cast<uint8_t>(m_converter.kind());
+            m_header->fraction_digits = m_converter.fraction_digits();
+            m_header->pid = static_cast<uint32_t>(getpid());
+            uint64_t anchor_raw, anchor_ns;
+            double ns_per_tick;
+            m_converter.anchor(anchor_raw, anchor_ns, ns_per_tick);
+            publish_calibration(anchor_raw, anchor_ns, ns_per_tick);
+            site_registry().subscribe(this);
+
+            if (!m_dump_path.empty())
+            {
+                install_signal_handlers();
+                crash_recorder.store(this, std::memory_order_release);
+            }
+        }
+
+        /*
+         * Space for one record, from this thread's chunk so the shared write position is only
+         * touched once per chunk. A chunk the ring lapped in the meantime is abandoned, the
+         * unused rest of a chunk holds no valid record and recovery skips it.
+         */
+        uint64_t reserve(size_t const total)
+        {
+            if (total > m_chunk_size)
+                return m_header->write.fetch_add(total, std::memory_order_relaxed);
+
+            RecorderChunk *chunk = nullptr;
+            for (auto &entry : recorder_chunks)
+            {
+                if (entry.id == m_id)
+                    chunk = &entry;
+            }
+            if (chunk == nullptr)
+            {
+                recorder_chunks.push_back(RecorderChunk{m_id, 0, 0});
+                chunk = &recorder_chunks.back();
+            }
+
+            if (chunk->end - chunk->next < total || m_header->write.load(std::memory_order_relaxed) - chunk->next > m_data_size - m_chunk_size)
+            {
+                chunk->next = m_header->write.fetch_add(m_chunk_size, std::memory_order_relaxed);
+                chunk->end = chunk->next + m_chunk_size;
+            }
+            uint64_t const position = chunk->next;
+            chunk->next += total;
+            return position;
+        }
+
+        static size_t record_size(size_t length)
+        {
+            return (record_header_size + length + 7) & ~static_cast<size_t>(7);
+        }
+
+        static uint32_t check(uint64_t position, uint32_t length)
+        {
+            return static_cast<uint32_t>(position ^ (position >> 32)) ^ length ^ 0x4c4c4f47u;
+        }
+
+        void copy_in(uint64_t &at, char const *source, size_t length)
+        {
+            size_t const offset = at & m_mask;
+            size_t const first = std::min(length, m_data_size - offset);
+            memcpy(m_data + offset, source, first);
+            memcpy(m_data, source + first, length - first);
+            at += length;
+        }
+
+        void publish_calibration(uint64_t anchor_raw, uint64_t anchor_ns, double ns_per_tick)
+        {
+            uint64_t const sequence = m_header->calibration_sequence.load(std::memory_order_relaxed);
+            m_header->calibration_sequence.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            m_header->anchor_raw = anchor_raw;
+            m_header->anchor_ns = anchor_ns;
+            m_header->ns_per_tick = ns_per_tick;
+            m_header->calibration_sequence.store(sequence + 2, std::memory_order_release);
+        }
+
+        // Appends the site to the table, a full table leaves later sites without a location in recovered lines.
+        void site_added(uint32_t id, LogSite const &site) override
+        {
+            if (m_sites_full)
+                return;
+            uint64_t const used = m_header->site_bytes.load(std::memory_order_relaxed);
+            uint16_t const file_length = static_cast<uint16_t>(std::min<size_t>(strlen(site.file), UINT16_MAX));
+            uint16_t const function_length = static_cast<uint16_t>(std::min<size_t>(strlen(site.function), UINT16_MAX));
+            size_t const size = (site_entry_size + file_length + function_length + 7) & ~static_cast<size_t>(7);
+            if (used + size > sites_size)
+            {
+                m_sites_full = true;
+                return;
+            }
+
+            char *p = m_sites + used;
+            uint32_t const values[2] = {id, site.line};
+            uint8_t const level[2] = {static_cast<uint8_t>(site.level), 0};
+            uint16_t const lengths[3] = {file_length, function_length, 0};
+            memcpy(p, values, sizeof(values));
+            memcpy(p + sizeof(values), level, sizeof(level));
+            memcpy(p + sizeof(values) + sizeof(level), lengths, sizeof(lengths));
+            memcpy(p + site_entry_size, site.file, file_length);
+            memcpy(p + site_entry_size + file_length, site.function, function_length);
+            m_header->site_bytes.store(used + size, std::memory_order_release);
+        }
+
+        static void install_signal_handlers();
+        static void on_fatal_signal(int signal);
+
+    private:
+        static std::atomic<FlightRecorder *> crash_recorder;
+
+        uint64_t const m_id;
+        std::string const m_path;
+        std::string const m_dump_path;
+        char *const m_region;
+        size_t const m_region_size;
+        Header *const m_header;
+        char *const m_sites;
+        char *const m_data;
+        size_t const m_data_size;
+        size_t const m_mask;
+        size_t const m_chunk_size;
+        // Under the site registry lock.
+        bool m_sites_full;
+        TimestampConverter m_converter;
+    };
+
+    std::atomic<FlightRecorder *> FlightRecorder::crash_recorder{nullptr};
+
+    int const fatal_signals[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+    struct sigaction previous_fatal_actions[sizeof(fatal_signals) / sizeof(fatal_signals[0])];
+
+    void FlightRecorder::install_signal_handlers()
+    {
+        static std::once_flag installed;
+        std::call_once(installed, [] {
+            struct sigaction action;
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = &FlightRecorder::on_fatal_signal;
+            sigemptyset(&action.sa_mask);
+            for (size_t i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); ++i)
+                sigaction(fatal_signals[i], &action, &previous_fatal_actions[i]);
+        });
+    }
+
+    void FlightRecorder::on_fatal_signal(int signal)
+    {
+        FlightRecorder *recorder = crash_recorder.exchange(nullptr);
+        if (recorder != nullptr)
+            recorder->dump();
+
+        // Hand the signal to whoever handled it before, by default that terminates the process.
+        for (size_t i = 0; i < sizeof(fatal_signals) / sizeof(fatal_signals[0]); ++i)
+        {
+            if (fatal_signals[i] == signal)
+                sigaction(signal, &previous_fatal_actions[i], nullptr);
+        }
+        raise(signal);
+    }
+
+    bool FlightRecorder::recover(std::string const &region, std::ostream &os)
+    {
+        Header header;
+        if (region.size() < header_page)
+            return false;
+        memcpy(static_cast<void *>(&header), region.data(), sizeof(header));
+        if (memcmp(header.magic, flight_recorder_magic, sizeof(flight_recorder_magic)) != 0 ||
+            header.sites_offset + header.sites_size > region.size() || header.data_offset + header.data_size > region.size() ||
+            header.data_size < record_header_size || (header.data_size & (header.data_size - 1)) != 0)
+            return false;
+
+        BinaryCodec::ReadState state;
+        char const *sites = region.data() + header.sites_offset;
+        uint64_t const site_bytes = std::min<uint64_t>(header.site_bytes.load(), header.sites_size);
+        for (uint64_t used = 0; used + site_entry_size <= site_bytes;)
+        {
+            char const *p = sites + used;
+            uint32_t values[2];
+            uint16_t lengths[3];
+            memcpy(values, p, sizeof(values));
+            memcpy(lengths, p + sizeof(values) + 2, sizeof(lengths));
+            size_t const size = (site_entry_size + lengths[0] + lengths[1] + 7) & ~static_cast<size_t>(7);
+            if (used + size > site_bytes)
+                break;
+            uint8_t const level = static_cast<uint8_t>(p[sizeof(values)]);
+            char const *file = state.pool.insert(std::string(p + site_entry_size, lengths[0])).first->c_str();
+            char const *function = state.pool.insert(std::string(p + site_entry_size + lengths[0], lengths[1])).first->c_str();
+            LogLevel const site_level = level <= static_cast<uint8_t>(LogLevel::CRIT) ? static_cast<LogLevel>(level) : LogLevel::INFO;
+            state.sites.add(values[0], file, function, values[1], site_level);
+            used += size;
+        }
+
+        char const *data = region.data() + header.data_offset;
+        uint64_t const mask = header.data_size - 1;
+        auto copy_out = [&](uint64_t at, char *target, size_t length) {
+            size_t const offset = at & mask;
+            size_t const first = std::min<size_t>(length, header.data_size - offset);
+            memcpy(target, data + offset, first);
+            memcpy(target + first, data, length - first);
+        };
+
+        uint64_t const write = header.write.load();
+        std::vector<std::pair<uint64_t, std::string>> records;
+        // Only what the last lap left behind is intact, older records are partly overwritten.
+        uint64_t position = write > header.data_size ? write - header.data_size : 0;
+        position = (position + 7) & ~static_cast<uint64_t>(7);
+        while (position + record_header_size <= write)
+        {
+            uint32_t words[2];
+            uint64_t stored_position;
+            copy_out(position, reinterpret_cast<char *>(words), sizeof(words));
+            copy_out(position + sizeof(words), reinterpret_cast<char *>(&stored_position), sizeof(stored_position));
+            size_t const total = record_size(words[0]);
+            if (stored_position != position || words[1] != check(position, words[0]) || total > header.data_size / 2 || position + total > write)
+            {
+                // A record that was never finished, resynchronise on the next valid one.
+                position += 8;
+                continue;
+            }
+
+            std::string payload(words[0], '\0');
+            copy_out(position + record_header_size, &payload[0], words[0]);
+            position += total;
+            uint64_t timestamp = 0;
+            memcpy(&timestamp, payload.data(), std::min(payload.size(), sizeof(timestamp)));
+            records.emplace_back(timestamp, std::move(payload));
+        }
+
+        // Threads fill their own chunks, ring order is only per thread.
+        std::stable_sort(records.begin(), records.end(),
+                         [](std::pair<uint64_t, std::string> const &a, std::pair<uint64_t, std::string> const &b) { return a.first < b.first; });
+
+        LineFormatter formatter;
+        formatter.set_fraction_digits(header.fraction_digits == 9 ? 9 : 6);
+        formatter.set_sites(&state.sites);
+        LLogLine logline(LogLevel::INFO, SiteRegistry::unknown_site);
+        for (auto const &record : records)
+        {
+            if (!BinaryCodec::rebuild(record.second, state, logline))
+                continue;
+
+            uint64_t const raw = logline.timestamp();
+            uint64_t nanoseconds = raw * 1000;
+            if (header.timestamp_kind != static_cast<uint8_t>(TimestampKind::SYSTEM_MICROSECONDS))
+            {
+                double const elapsed = raw >= header.anchor_raw ? static_cast<double>(raw - header.anchor_raw) : -static_cast<double>(header.anchor_raw - raw);
+                nanoseconds = header.anchor_ns + static_cast<int64_t>(elapsed * header.ns_per_tick);
+            }
+            formatter.clear();
+            formatter.format(logline, nanoseconds);
+            os.write(formatter.data(), formatter.size());
+        }
+        return true;
+    }
+
+    bool recover_flight_recorder(std::istream &is, std::ostream &os)
+    {
+        std::string region((std::istreambuf_iterator<char>(is)), std::istreambuf_iterator<char>());
+        return FlightRecorder::recover(region, os);
+    }
+
+    constexpr size_t FlightRecorder::header_page;
+    constexpr size_t FlightRecorder::sites_size;
+    constexpr size_t FlightRecorder::record_header_size;
+    constexpr size_t FlightRecorder::site_entry_size;
+    constexpr size_t FlightRecorder::max_chunk_size;
+
+    // Indexed by LogFormat.
+    char const *const file_extensions[] = {".txt", ".bin", ".jsonl", ".log"};
+
+    /*
+     * Helper thread for the file system work of rolling, the consumer only swaps descriptors.
+     * It opens the next file ahead of time as a spare, renames the spare once the consumer took
+     * it, trims, syncs and closes finished files and deletes the oldest rolled files beyond the
+     * retention limits. With ROLLED compression a second thread at the lowest priority
+     * compresses finished files, sleeping as needed to stay within its share of a core.
+     */
+    class FileRoller
+    {
+    public:
+        FileRoller(LogFile const &file, std::string const &name, std::string const &extension, bool timestamped, LoggerOptions const &options)
+            : m_file(file), m_spare_path(name + ".next" + extension), m_max_files(options.max_files),
+              m_max_total_bytes(static_cast<uint64_t>(options.max_total_mb) * 1024 * 1024), m_retained_bytes(0), m_spare(-1),
+              m_spare_pending(false), m_stop(false), m_compress(options.compression == Compression::ROLLED),
+              m_cpu_percent(std::max(1u, std::min(100u, options.compression_cpu_percent))), m_stop_compressing(false)
+        {
+            // Timestamped names do not overwrite earlier runs, their files count against retention.
+            if (timestamped)
+                find_earlier_files(name, extension);
+            m_thread = std::thread(&FileRoller::run, this);
+            if (m_compress)
+                m_compressor = std::thread(&FileRoller::compress_files, this);
+        }
+
+        ~FileRoller()
+        {
+            // Files still waiting stay uncompressed rather than holding up the shutdown.
+            if (m_compress)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_compress_mutex);
+                    m_stop_compressing.store(true, std::memory_order_relaxed);
+                }
+                m_compress_wake.notify_one();
+                m_compressor.join();
+            }
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_wake.notify_one();
+            m_thread.join();
+            if (m_spare != -1)
+            {
+                ::close(m_spare);
+                ::unlink(m_spare_path.c_str());
+            }
+        }
+
+        // The spare file, or -1 while it is not open yet. A taken spare must be named by adopt().
+        int take_spare()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            int const fd = m_spare;
+            m_spare = -1;
+            return fd;
+        }
+
+        void adopt(std::string const &path)
+        {
+            push(Task{Task::RENAME, -1, 0, path});
+            prepare_spare();
+        }
+
+        void prepare_spare()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_spare_pending || m_spare != -1)
+                    return;
+                m_spare_pending = true;
+                m_tasks.push_back(Task{Task::CREATE, -1, 0, std::string()});
+            }
+            m_wake.notify_one();
+        }
+
+        // Finishes a file detached from the LogFile and counts it against retention.
+        void retire(int fd, uint64_t length, std::string const &path)
+        {
+            push(Task{Task::RETIRE, fd, length, path});
+        }
+
+        FileRoller(FileRoller const &) = delete;
+        FileRoller &operator=(FileRoller const &) = delete;
+
+    private:
+        static constexpr size_t compress_block_size = 1 << 20;
+
+        struct Task
+        {
+            enum Kind : uint8_t
+            {
+                CREATE,
+                RENAME,
+                RETIRE,
+                // path was replaced by path.lz of length bytes.
+                COMPRESSED
+            };
+
+            Kind kind;
+            int fd;
+            uint64_t length;
+            std::string path;
+        };
+
+        struct RetainedFile
+        {
+            std::string path;
+            uint64_t length;
+        };
+
+        void push(Task &&task)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_tasks.push_back(std::move(task));
+            }
+            m_wake.notify_one();
+        }
+
+        void run()
+        {
+            enforce_retention();
+            std::unique_lock<std::mutex> lock(m_mutex);
+            while (true)
+            {
+                m_wake.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+                // Stopping still drains the queue.
+                if (m_tasks.empty())
+                    return;
+                Task task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+                lock.unlock();
+                execute(task);
+                lock.lock();
+            }
+        }
+
+        void execute(Task const &task)
+        {
+            switch (task.kind)
+            {
+            case Task::CREATE:
+            {
+                int const fd = m_file.create(m_spare_path);
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_spare = fd;
+                m_spare_pending = false;
+                return;
+            }
+            case Task::RENAME:
+                ::rename(m_spare_path.c_str(), task.path.c_str());
+                return;
+            case Task::RETIRE:
+                m_file.finish(task.fd, task.length, true);
+                m_retained.push_back(RetainedFile{task.path, task.length});
+                m_retained_bytes += task.length;
+                enforce_retention();
+                if (m_compress)
+                {
+                    {
+                        std::lock_guard<std::mutex> lock(m_compress_mutex);
+                        m_to_compress.push_back(task.path);
+                    }
+                    m_compress_wake.notify_one();
+                }
+                return;
+            case Task::COMPRESSED:
+                for (RetainedFile &retained : m_retained)
+                {
+                    if (retained.path == task.path)
+                    {
+                        retained.path.append(".lz");
+                        m_retained_bytes = m_retained_bytes - retained.length + task.length;
+                        retained.length = task.length;
+                        return;
+                    }
+                }
+                // Retention dropped the file while it was being compressed.
+                ::unlink((task.path + ".lz").c_str());
+                return;
+            }
+        }
+
+        void compress_files()
+        {
+            // Below everything else, it only has to keep up on average.
+            setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), 19);
+            LzCodec codec;
+            std::vector<char> block(compress_block_size);
+            std::vector<char> frame;
+            std::unique_lock<std::mutex> lock(m_compress_mutex);
+            while (true)
+            {
+                m_compress_wake.wait(lock, [this] { return m_stop_compressing.load(std::memory_order_relaxed) || !m_to_compress.empty(); });
+                if (m_stop_compressing.load(std::memory_order_relaxed))
+                    return;
+                std::string const path = std::move(m_to_compress.front());
+                m_to_compress.pop_front();
+                lock.unlock();
+                uint64_t length = 0;
+                if (compress_file(codec, path, block, frame, length))
+                    push(Task{Task::COMPRESSED, -1, length, path});
+                lock.lock();
+            }
+        }
+
+        // Writes path.lz and removes path, false leaves path as it was.
+        bool compress_file(LzCodec &codec, std::string const &path, std::vector<char> &block, std::vector<char> &frame, uint64_t &length)
+        {
+            int const in = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (in == -1)
+                return false;
+            std::string const target = path + ".lz";
+            int const out = ::open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            bool ok = out != -1 && write_fully(out, compressed_log_magic, sizeof(compressed_log_magic));
+            length = sizeof(compressed_log_magic);
+            while (ok)
+            {
+                size_t filled = 0;
+                while (filled < block.size())
+                {
+                    ssize_t const n = ::read(in, block.data() + filled, block.size() - filled);
+                    if (n < 0 && errno == EINTR)
+                        continue;
+                    if (n <= 0)
+                    {
+                        ok = n == 0;
+                        break;
+                    }
+                    filled += n;
+                }
+                if (!ok || filled == 0)
+                    break;
+
+                uint64_t const begin = thread_cpu_nanoseconds();
+                encode_frame(codec, block.data(), static_cast<uint32_t>(filled), true, frame);
+                ok = write_fully(out, frame.data(), frame.size());
+                length += frame.size();
+
+                uint64_t const spent = thread_cpu_nanoseconds() - begin;
+                std::unique_lock<std::mutex> lock(m_compress_mutex);
+                if (m_compress_wake.wait_for(lock, std::chrono::nanoseconds(spent * (100 - m_cpu_percent) / m_cpu_percent),
+                                             [this] { return m_stop_compressing.load(std::memory_order_relaxed); }))
+                    ok = false;
+            }
+            ::close(in);
+            if (out != -1)
+            {
+                if (ok)
+                    fdatasync(out);
+                ::close(out);
+            }
+            if (!ok)
+            {
+                ::unlink(target.c_str());
+                return false;
+            }
+            ::unlink(path.c_str());
+            return true;
+        }
+
+        void enforce_retention()
+        {
+            while (!m_retained.empty() && ((m_max_files != 0 && m_retained.size() > m_max_files) ||
+                                            (m_max_total_bytes != 0 && m_retained_bytes > m_max_total_bytes)))
+            {
+                ::unlink(m_retained.front().path.c_str());
+                m_retained_bytes -= m_retained.front().length;
+                m_retained.pop_front();
+            }
+        }
+
+        static bool ends_with(std::string const &s, std::string const &suffix)
+        {
+            return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+        }
+
+        // name.YYYYmmdd-HHMMSS.N.ext and .ext.lz files in the log directory, oldest first.
+        void find_earlier_files(std::string const &name, std::string const &extension)
+        {
+            size_t const slash = name.rfind('/');
+            std::string const directory = slash == std::string::npos ? "." : name.substr(0, slash + 1);
+            std::string const prefix = (slash == std::string::npos ? name : name.substr(slash + 1)) + ".";
+            DIR *dir = opendir(directory.c_str());
+            if (!dir)
+                return;
+
+            std::string const compressed = extension + ".lz";
+            std::vector<std::tuple<int64_t, std::string, uint64_t>> found;
+            while (dirent *entry = readdir(dir))
+            {
+                std::string const file = entry->d_name;
+                size_t suffix = 0;
+                if (ends_with(file, compressed))
+                    suffix = compressed.size();
+                else if (ends_with(file, extension))
+                    suffix = extension.size();
+                if (suffix == 0 || file.size() < prefix.size() + suffix + 17 || file.compare(0, prefix.size(), prefix) != 0)
+                    continue;
+                std::string const middle = file.substr(prefix.size(), file.size() - prefix.size() - suffix);
+                bool matches = middle[8] == '-' && middle[15] == '.';
+                for (size_t i = 0; matches && i < middle.size(); ++i)
+                    matches = i == 8 || i == 15 || (middle[i] >= '0' && middle[i] <= '9');
+                struct stat status;
+                std::string const path = slash == std::string::npos ? file : directory + file;
+                if (matches && ::stat(path.c_str(), &status) == 0)
+                {
+                    int64_t const modified = static_cast<int64_t>(status.st_mtim.tv_sec) * 1000000000 + status.st_mtim.tv_nsec;
+                    found.emplace_back(modified, path, static_cast<uint64_t>(status.st_size));
+                }
+            }
+            closedir(dir);
+
+            std::sort(found.begin(), found.end());
+            for (auto const &f : found)
+            {
+                m_retained.push_back(RetainedFile{std::get<1>(f), std::get<2>(f)});
+                m_retained_bytes += std::get<2>(f);
+            }
+        }
+
+    private:
+        LogFile const &m_file;
+        std::string const m_spare_path;
+        uint32_t const m_max_files;
+        uint64_t const m_max_total_bytes;
+        // Helper thread only.
+        std::deque<RetainedFile> m_retained;
+        uint64_t m_retained_bytes;
+        std::mutex m_mutex;
+        std::condition_variable m_wake;
+        std::deque<Task> m_tasks;
+        int m_spare;
+        bool m_spare_pending;
+        bool m_stop;
+        std::thread m_thread;
+        bool const m_compress;
+        uint32_t const m_cpu_percent;
+        std::mutex m_compress_mutex;
+        std::condition_variable m_compress_wake;
+        std::deque<std::string> m_to_compress;
+        std::atomic<bool> m_stop_compressing;
+        std::thread m_compressor;
+    };
+
+    constexpr size_t FileRoller::compress_block_size;
+
+    /*
+     * Writes records to the rolling log file and fans them out to the configured sinks.
+     * The level is checked against every destination before anything is formatted, and the
+     * text form is built once and shared by the file and all text sinks.
+     */
+    class FileWriter
+    {
+    public:
+        FileWriter(std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options)
+            : m_log_file_roll_size_bytes(log_file_roll_size_mb * 1024 * 1024), m_name(log_directory + log_file_name), m_format(options.format),
+              m_file_min_level(options.file_min_level), m_flush_interval(std::chrono::milliseconds(options.flush_interval_ms)),
+              m_extension(std::string(file_extensions[static_cast<size_t>(options.format)]) + (options.compression == Compression::STREAMING ? ".lz" : "")),
+              m_file(std::max(static_cast<size_t>(4), static_cast<size_t>(options.write_block_size_kb)) * 1024, options.io_backend,
+                     options.io_queue_depth, m_log_file_roll_size_bytes, options.compression, options.compression_cpu_percent),
+              m_os(&m_file), m_rotation(options.rotation),
+              m_roller(m_file, m_name, m_extension, options.rotation != Rotation::NONE, options),
+              m_last_flush(std::chrono::steady_clock::now()), m_group_commit(std::chrono::microseconds(options.group_commit_us))
+        {
+            std::copy(std::begin(options.durability), std::end(options.durability), m_durability);
+            m_formatter.set_fraction_digits(m_converter.fraction_digits());
+            for (auto const &sink : options.sinks)
+            {
+                if (sink)
+                    m_sinks.emplace_back(new SinkState(sink));
+            }
+            roll_file(realtime_nanoseconds());
+        }
+
+        ~FileWriter()
+        {
+            m_file.close();
+        }
+
+        void write(LLogLine &logline)
+        {
+            auto const begin = std::chrono::steady_clock::now();
+            uint64_t const nanoseconds = m_converter.to_nanoseconds(logline.timestamp());
+            LogLevel const level = BinaryCodec::level(logline);
+            // What m_formatter holds for this record, BINARY for nothing yet.
+            LogFormat formatted = LogFormat::BINARY;
+
+            // Before the write, the first line of a new period opens and names its file.
+            if (nanoseconds >= m_next_rotation)
+                roll_file(nanoseconds);
+
+            if (level >= m_file_min_level)
+            {
+                if (m_format == LogFormat::BINARY)
+                {
+                    BinaryCodec::write(logline, nanoseconds, m_os, m_binary_state);
+                    if (durability(level) != Durability::NONE)
+                        m_os.flush();
+                }
+                else
+                {
+                    format_line(logline, nanoseconds, m_format, formatted);
+                    m_file.sputn(m_formatter.data(), m_formatter.size());
+                    if (durability(level) != Durability::NONE)
+                        m_file.flush();
+                }
+            }
+
+            for (auto &state : m_sinks)
+            {
+                if (level >= state->sink->min_level())
+                    write_to_sink(*state, logline, nanoseconds, level, formatted);
+            }
+
+            if (durability(level) == Durability::SYNCED)
+            {
+                if (m_unsynced.empty())
+                    m_unsynced_since = begin;
+                m_unsynced.push_back(BinaryCodec::thread(logline));
+            }
 
-        Buffer()
-        {
-            for (size_t i = 0; i <= size; ++i)
+            if (m_file.bytes_written() > m_log_file_roll_size_bytes)
             {
-                m_write_state[i].store(0, std::memory_order_relaxed);
+                roll_file(nanoseconds);
             }
-            static_assert(sizeof(Item) == 256, "Unexcepted size != 256");
+            else if ((++m_writes_since_check & 255) == 0)
+            {
+                flush_if_due();
+            }
+
+            m_last_timestamp.store(nanoseconds, std::memory_order_relaxed);
+            m_bytes_written.store(m_rolled_bytes + m_file.bytes_written(), std::memory_order_relaxed);
+            record_write_time(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count());
         }
 
-        ~Buffer()
+        // Bounds the delay of a partially filled block, called by the consumer when it runs dry.
+        void flush_if_due()
         {
-            unsigned int write_count = m_write_state[size].load();
-            for (size_t i = 0; i < write_count; ++i)
+            if (!m_file.has_pending())
+                return;
+            auto const now = std::chrono::steady_clock::now();
+            if (now - m_last_flush >= m_flush_interval)
             {
-                m_buffer[i].~Item();
+                m_file.flush();
+                m_last_flush = now;
             }
-            std::free(m_buffer);
         }
 
-        bool push(LLogLine &&logline, unsigned int const write_index)
+        void flush()
         {
-            new (&m_buffer[write_index]) Item(std::move(logline));
-            m_write_state[write_index].store(1, std::memory_order_release);
-            return m_write_state[size].fetch_add(1, std::memory_order_acquire) + 1 == size;
+            m_file.flush();
+            for (auto &state : m_sinks)
+                state->sink->flush();
+            m_last_flush = std::chrono::steady_clock::now();
         }
 
-        bool try_pop(LLogLine &logline, unsigned int const read_index)
+        // Read by producers, set before the consumer starts.
+        Durability durability(LogLevel level) const
         {
-            if (m_write_state[read_index].load(std::memory_order_acquire))
-            {
-                Item &item = m_buffer[read_index];
-                logline = std::move(item.logline);
-                return true;
-            }
-            return false;
+            return m_durability[static_cast<size_t>(level)];
         }
 
-        Buffer(Buffer const &) = delete;
-        Buffer &operator=(Buffer const &) = delete;
+        // SYNCED lines were written since the last sync().
+        bool sync_due() const
+        {
+            return !m_unsynced.empty();
+        }
+
+        bool sync_overdue() const
+        {
+            return !m_unsynced.empty() && std::chrono::steady_clock::now() - m_unsynced_since >= m_group_commit;
+        }
+
+        // Flushes and fdatasyncs the file, threads gets the loggers of the SYNCED lines it covered.
+        void sync(std::vector<std::thread::id> &threads)
+        {
+            flush();
+            m_file.sync_data();
+            threads.swap(m_unsynced);
+            m_unsynced.clear();
+        }
+
+        // Writes "N records dropped between T1 and T2" for drops with raw timestamps first and last.
+        void write_drop_report(uint64_t count, uint64_t first, uint64_t last)
+        {
+            static uint32_t const site_id = register_site("llog", "overflow", 0, LogLevel::WARN);
+            m_formatter.clear();
+            m_formatter.append_timestamp(m_converter.to_nanoseconds(first));
+            std::string const since(m_formatter.data(), m_formatter.size());
+            m_formatter.clear();
+            m_formatter.append_timestamp(m_converter.to_nanoseconds(last));
+            std::string const until(m_formatter.data(), m_formatter.size());
+
+            LLogLine logline(LogLevel::WARN, site_id);
+            logline << count << " records dropped between " << since << " and " << until;
+            write(logline);
+        }
+
+        // Read by stats() on any thread while the consumer writes.
+        void collect_stats(LoggerStats &stats) const
+        {
+            stats.bytes_written = m_bytes_written.load(std::memory_order_relaxed);
+            stats.file_rolls = m_file_rolls.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < LoggerStats::write_time_buckets; ++i)
+                stats.write_time_ns[i] = m_write_time_ns[i].load(std::memory_order_relaxed);
+        }
+
+        uint64_t last_timestamp() const
+        {
+            return m_last_timestamp.load(std::memory_order_relaxed);
+        }
 
     private:
-        Item *m_buffer;
-        std::atomic<unsigned int> m_write_state[size + 1];
-    };
+        struct SinkState
+        {
+            SinkState(std::shared_ptr<Sink> const &sink_) : sink(sink_), started(false) {}
 
-    class QueueBuffer : public BufferBase
-    {
-    public:
-        QueueBuffer(QueueBuffer const &) = delete;
-        QueueBuffer &operator=(QueueBuffer const &) = delete;
+            std::shared_ptr<Sink> sink;
+            // Binary sinks only.
+            BinaryCodec::WriteState binary_state;
+            std::ostringstream binary;
+            bool started;
+        };
 
-        QueueBuffer() : m_current_read_buffer{nullptr}, m_write_index(0), m_flag{ATOMIC_FLAG_INIT}, m_read_index(0)
+        void format_line(LLogLine &logline, uint64_t nanoseconds, LogFormat format, LogFormat &formatted)
         {
-            setup_next_write_buffer();
+            if (formatted == format)
+                return;
+            m_formatter.clear();
+            m_formatter.format(logline, nanoseconds, format);
+            formatted = format;
         }
 
-        void push(LLogLine &&logline) override
+        void write_to_sink(SinkState &state, LLogLine &logline, uint64_t nanoseconds, LogLevel level, LogFormat &formatted)
         {
-            unsigned int write_index = m_write_index.fetch_add(1, std::memory_order_relaxed);
-            if (write_index < Buffer::size)
+            bool delivered;
+            if (state.sink->format() == LogFormat::BINARY)
             {
-                if (m_current_write_buffer.load(std::memory_order_acquire)->push(std::move(logline), write_index))
+                state.binary.str(std::string());
+                if (!state.started)
                 {
-                    setup_next_write_buffer();
+                    state.binary_state.reset();
+                    BinaryCodec::write_header(state.binary, m_converter.fraction_digits());
                 }
+                BinaryCodec::write(logline, nanoseconds, state.binary, state.binary_state);
+                std::string const &data = state.binary.str();
+                delivered = state.sink->write(data.data(), data.size(), level);
             }
             else
             {
-                while (m_write_index.load(std::memory_order_acquire) >= Buffer::size)
-                    ;
-                push(std::move(logline));
+                format_line(logline, nanoseconds, state.sink->format(), formatted);
+                delivered = state.sink->write(m_formatter.data(), m_formatter.size(), level);
             }
+            state.started = delivered;
+            if (durability(level) != Durability::NONE)
+                state.sink->flush();
         }
 
-        bool try_pop(LLogLine &logline) override
+        void record_write_time(uint64_t nanoseconds)
         {
-            if (m_current_read_buffer == nullptr)
-                m_current_read_buffer = get_next_read_buffer();
-
-            Buffer *read_buffer = m_current_read_buffer;
-
-            if (read_buffer == nullptr)
-                return false;
-
-            if (bool success = read_buffer->try_pop(logline, m_read_index))
+            size_t bucket = 0;
+            while (nanoseconds > 1 && bucket + 1 < LoggerStats::write_time_buckets)
             {
-                m_read_index++;
-                if (m_read_index == Buffer::size)
-                {
-                    m_read_index = 0;
-                    m_current_read_buffer = nullptr;
-                    SpinLock spinlock(m_flag);
-                    m_buffers.pop();
-                }
-                return true;
+                nanoseconds >>= 1;
+                ++bucket;
             }
-            return false;
+            // Only the consumer writes, no read-modify-write needed.
+            m_write_time_ns[bucket].store(m_write_time_ns[bucket].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
         }
 
-    private:
-        void setup_next_write_buffer()
+        // Swaps in the spare the roller opened, the old file is finished on the roller's thread.
+        void roll_file(uint64_t nanoseconds)
         {
-            std::unique_ptr<Buffer> next_write_buffer(new Buffer());
-            m_current_write_buffer.store(next_write_buffer.get(), std::memory_order_release);
-            SpinLock spinlock(m_flag);
-            m_buffers.push(std::move(next_write_buffer));
-            m_write_index.store(0, std::memory_order_relaxed);
-        }
+            if (m_file_number != 0)
+            {
+                // Waiting SYNCED lines must not depend on the roller's asynchronous sync.
+                if (!m_unsynced.empty())
+                    m_file.sync_data();
+                uint64_t const length = m_file.bytes_written();
+                m_rolled_bytes += length;
+                m_file_rolls.store(m_file_number, std::memory_order_relaxed);
+                m_roller.retire(m_file.detach(), length, m_path);
+            }
 
-        Buffer *get_next_read_buffer()
-        {
-            SpinLock spinlock(m_flag);
-            return m_buffers.empty() ? nullptr : m_buffers.front().get();
+            m_path = m_name;
+            m_path.append(".");
+            if (m_rotation != Rotation::NONE)
+            {
+                time_t const seconds = static_cast<time_t>(nanoseconds / 1000000000);
+                tm parts;
+                char stamp[32];
+                gmtime_r(&seconds, &parts);
+                m_path.append(stamp, strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S.", &parts));
+
+                uint64_t const period = (m_rotation == Rotation::HOURLY ? 3600ull : 86400ull) * 1000000000;
+                m_next_rotation = (nanoseconds / period + 1) * period;
+            }
+            m_path.append(std::to_string(++m_file_number));
+            m_path.append(m_extension);
+
+            int fd = m_roller.take_spare();
+            if (fd != -1)
+            {
+                m_roller.adopt(m_path);
+            }
+            else
+            {
+                // The roller fell behind, opening here is still correct.
+                fd = m_file.create(m_path);
+                m_roller.prepare_spare();
+            }
+            m_file.attach(fd);
+
+            if (m_format == LogFormat::BINARY)
+            {
+                m_binary_state.reset();
+                BinaryCodec::write_header(m_os, m_converter.fraction_digits());
+            }
         }
 
     private:
-        std::queue<std::unique_ptr<Buffer>> m_buffers;
-        std::atomic<Buffer *> m_current_write_buffer;
-        Buffer *m_current_read_buffer;
-        std::atomic<unsigned int> m_write_index;
-        std::atomic_flag m_flag;
-        unsigned int m_read_index;
+        uint32_t m_file_number = 0;
+        uint32_t m_writes_since_check = 0;
+        uint32_t const m_log_file_roll_size_bytes;
+        std::string const m_name;
+        LogFormat const m_format;
+        LogLevel const m_file_min_level;
+        std::chrono::steady_clock::duration const m_flush_interval;
+        std::string const m_extension;
+        LogFile m_file;
+        std::ostream m_os;
+        Rotation const m_rotation;
+        uint64_t m_next_rotation = UINT64_MAX;
+        std::string m_path;
+        // After m_file, whose create() and finish() it calls until it is joined.
+        FileRoller m_roller;
+        std::chrono::steady_clock::time_point m_last_flush;
+        std::chrono::steady_clock::duration const m_group_commit;
+        Durability m_durability[5];
+        std::vector<std::thread::id> m_unsynced;
+        std::chrono::steady_clock::time_point m_unsynced_since;
+        TimestampConverter m_converter;
+        LineFormatter m_formatter;
+        BinaryCodec::WriteState m_binary_state;
+        uint64_t m_rolled_bytes = 0;
+        std::atomic<uint64_t> m_bytes_written{0};
+        std::atomic<uint64_t> m_file_rolls{0};
+        std::atomic<uint64_t> m_last_timestamp{0};
+        std::atomic<uint64_t> m_write_time_ns[LoggerStats::write_time_buckets] = {};
+        std::vector<std::unique_ptr<SinkState>> m_sinks;
     };
 
-    class FileWriter
+    /*
+     * How the consumer waits when the buffer is empty, see WaitStrategy.
+     * idle() is called after every failed try_pop and reset() after every successful one.
+     * In BLOCKING mode the consumer first announces that it is about to park and tries the
+     * buffer once more, producers only pay for a futex wake while the announcement is up.
+     */
+    class ConsumerWaiter
     {
     public:
-        FileWriter(std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb)
-            : m_log_file_roll_size_bytes(log_file_roll_size_mb * 1024 * 1024), m_name(log_directory + log_file_name)
+        ConsumerWaiter(LoggerOptions const &options)
+            : m_strategy(options.wait_strategy), m_max_backoff(std::chrono::microseconds(std::max(1u, options.max_backoff_us))),
+              m_park_timeout_ms(std::max(1u, options.flush_interval_ms)), m_parked(0), m_idle_count(0), m_announced(false), m_backoff(1)
         {
-            roll_file();
         }
 
-        void write(LLogLine &logline)
+        void reset()
         {
-            auto pos = m_os->tellp();
-            logline.stringify(*m_os);
-            m_bytes_written += m_os->tellp() - pos;
-            if (m_bytes_written > m_log_file_roll_size_bytes)
+            m_idle_count = 0;
+            m_backoff = std::chrono::microseconds(1);
+            if (m_announced)
             {
-                roll_file();
+                m_parked.store(0, std::memory_order_relaxed);
+                m_announced = false;
             }
         }
 
-    private:
-        void roll_file()
+        void idle()
         {
-            if (m_os)
+            switch (m_strategy)
             {
-                m_os->flush();
-                m_os->close();
+            case WaitStrategy::BUSY_SPIN:
+                cpu_relax();
+                return;
+            case WaitStrategy::SPIN_YIELD:
+                if (++m_idle_count < spin_limit)
+                    cpu_relax();
+                else
+                    std::this_thread::yield();
+                return;
+            case WaitStrategy::BACKOFF:
+                if (++m_idle_count < spin_limit)
+                {
+                    cpu_relax();
+                }
+                else if (m_idle_count < spin_limit + yield_limit)
+                {
+                    std::this_thread::yield();
+                }
+                else
+                {
+                    std::this_thread::sleep_for(m_backoff);
+                    m_backoff = std::min(m_backoff * 2, m_max_backoff);
+                }
+                return;
+            case WaitStrategy::BLOCKING:
+                if (++m_idle_count < spin_limit)
+                {
+                    cpu_relax();
+                }
+                else if (!m_announced)
+                {
+                    // The caller retries the buffer before the next idle() actually parks.
+                    m_parked.store(1, std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    m_announced = true;
+                }
+                else
+                {
+                    // Bounded so partially filled write blocks still get flushed on time.
+                    timespec timeout = {static_cast<time_t>(m_park_timeout_ms / 1000), static_cast<long>(m_park_timeout_ms % 1000) * 1000000};
+                    syscall(SYS_futex, &m_parked, FUTEX_WAIT_PRIVATE, 1, &timeout, nullptr, 0);
+                    m_parked.store(0, std::memory_order_relaxed);
+                    m_announced = false;
+                    m_idle_count = 0;
+                }
+                return;
             }
+        }
 
-            m_bytes_written = 0;
-            m_os.reset(new std::ofstream());
-
-            std::string log_file_name = m_name;
-            log_file_name.append(".");
-            log_file_name.append(std::to_string(++m_file_number));
-            log_file_name.append(".txt");
-            m_os->open(log_file_name, std::ofstream::out | std::ofstream::trunc);
+        // Producer side, after a push or a state change.
+        void notify()
+        {
+            if (m_strategy != WaitStrategy::BLOCKING)
+                return;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (m_parked.load(std::memory_order_relaxed) != 0 && m_parked.exchange(0, std::memory_order_relaxed) != 0)
+                syscall(SYS_futex, &m_parked, FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
         }
 
     private:
-        uint32_t m_file_number = 0;
-        std::streamoff m_bytes_written = 0;
-        uint32_t const m_log_file_roll_size_bytes;
-        std::string const m_name;
-        std::unique_ptr<std::ofstream> m_os;
+        static constexpr uint32_t spin_limit = 256;
+        static constexpr uint32_t yield_limit = 64;
+
+        WaitStrategy const m_strategy;
+        std::chrono::microseconds const m_max_backoff;
+        uint32_t const m_park_timeout_ms;
+        char pad0[64];
+        std::atomic<int> m_parked;
+        char pad1[64];
+        uint32_t m_idle_count;
+        bool m_announced;
+        std::chrono::microseconds m_backoff;
     };
 
     //This class has some problems
     class LLogger
     {
     public:
-        LLogger(NonGuaranteedLogger ngl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb)
-            : m_state(State::INIT), m_buffer_base(new RingBuffer(std::max(1u, ngl.ring_buffer_size_mb) * 1024 * 4)), m_file_writer(log_directory, log_file_name, std::max(1u, log_file_roll_size_mb)), m_thread(&LLogger::pop, this)
+        LLogger(NonGuaranteedLogger ngl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options)
+            : m_state(State::INIT), m_buffer_base(new RingBuffer(std::max(1u, ngl.ring_buffer_size_mb) * 1024 * 4, ngl.overflow_policy, ngl.block_timeout_us)), m_file_writer(log_directory, log_file_name, std::max(1u, log_file_roll_size_mb), options), m_waiter(options), m_recorder(FlightRecorder::open(options)), m_thread(&LLogger::pop, this)
         {
             m_state.store(State::READY, std::memory_order_release);
         }
 
-        LLogger(GuaranteedLogger gl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb)
-            : m_state(State::INIT), m_buffer_base(new QueueBuffer()), m_file_writer(log_directory, log_file_name, std::max(1u, log_file_roll_size_mb)), m_thread(&LLogger::pop, this)
+        LLogger(GuaranteedLogger gl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options)
+            : m_state(State::INIT), m_buffer_base(new QueueBuffer(gl.preallocated_segments, queue_segment_budget(gl.max_memory_mb))), m_file_writer(log_directory, log_file_name, std::max(1u, log_file_roll_size_mb), options), m_waiter(options), m_recorder(FlightRecorder::open(options)), m_thread(&LLogger::pop, this)
+        {
+            m_state.store(State::READY, std::memory_order_release);
+        }
+
+        LLogger(ByteRingLogger brl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options)
+            : m_state(State::INIT), m_buffer_base(new ByteRing(byte_ring_capacity(brl.ring_buffer_size_mb))), m_file_writer(log_directory, log_file_name, std::max(1u, log_file_roll_size_mb), options), m_waiter(options), m_recorder(FlightRecorder::open(options)), m_thread(&LLogger::pop, this)
+        {
+            m_state.store(State::READY, std::memory_order_release);
+        }
+
+        LLogger(PerThreadLogger ptl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options)
+            : m_state(State::INIT), m_buffer_base(new StagingBuffer(staging_ring_capacity(ptl.ring_buffer_size_kb))), m_file_writer(log_directory, log_file_name, std::max(1u, log_file_roll_size_mb), options), m_waiter(options), m_recorder(FlightRecorder::open(options)), m_thread(&LLogger::pop, this)
         {
             m_state.store(State::READY, std::memory_order_release);
         }
@@ -584,12 +5034,73 @@ namespace llog
         ~LLogger()
         {
             m_state.store(State::SHUTDOWN);
+            m_waiter.notify();
             m_thread.join();
         }
 
         void add(LLogLine &&logline)
         {
+            m_produced.increment();
+            bool const synced = m_file_writer.durability(BinaryCodec::level(logline)) == Durability::SYNCED;
+            if (m_recorder)
+                m_recorder->record(logline);
             m_buffer_base->push(std::move(logline));
+            m_waiter.notify();
+            if (synced)
+                wait_for_sync();
+        }
+
+        // For LLog::reserve. Lines the flight recorder keeps or a sync waits for go through add().
+        char *reserve(LogLevel level, uint32_t site_id, size_t length)
+        {
+            if (m_recorder || m_file_writer.durability(level) == Durability::SYNCED)
+                return nullptr;
+            char *const b = m_buffer_base->reserve(line_header_size + length);
+            if (b == nullptr)
+                return nullptr;
+            m_produced.increment();
+            encode_line_header(b, level, site_id);
+            return b + line_header_size;
+        }
+
+        void commit(char *arguments)
+        {
+            m_buffer_base->commit(arguments - line_header_size);
+            m_waiter.notify();
+        }
+
+        void flush(Durability durability)
+        {
+            if (durability == Durability::NONE)
+                return;
+            uint64_t const target = m_produced.load();
+            std::unique_lock<std::mutex> lock(m_flush_mutex);
+            uint64_t &requested = durability == Durability::SYNCED ? m_sync_target : m_write_target;
+            requested = std::max(requested, target);
+            m_flush_requested.store(true, std::memory_order_release);
+            m_waiter.notify();
+            uint64_t const &through = durability == Durability::SYNCED ? m_synced_through : m_written_through;
+            m_flushed.wait(lock, [&] { return through >= target; });
+        }
+
+        LoggerStats stats()
+        {
+            LoggerStats stats;
+            // Consumed first, so concurrent progress can only make pending look larger.
+            stats.consumed = m_consumed.load(std::memory_order_relaxed);
+            stats.dropped = m_buffer_base->drops.total();
+            stats.produced = m_produced.load();
+            uint64_t const done = stats.consumed + stats.dropped;
+            stats.pending = stats.produced > done ? stats.produced - done : 0;
+            stats.segments = m_buffer_base->segments();
+            if (stats.pending != 0)
+            {
+                uint64_t const now = realtime_nanoseconds();
+                uint64_t const last = m_file_writer.last_timestamp();
+                stats.consumer_lag_ns = last != 0 && now > last ? now - last : 0;
+            }
+            m_file_writer.collect_stats(stats);
+            return stats;
         }
 
         void pop()
@@ -598,24 +5109,162 @@ namespace llog
             while (m_state.load(std::memory_order_acquire) == State::INIT)
                 std::this_thread::sleep_for(std::chrono::microseconds(50));
 
-            LLogLine logline(LogLevel::INFO, nullptr, nullptr, 0);
+            LLogLine logline(LogLevel::INFO, SiteRegistry::unknown_site);
 
             while (m_state.load() == State::READY)
             {
                 if (m_buffer_base->try_pop(logline))
+                {
                     m_file_writer.write(logline);
+                    m_consumed.store(m_consumed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+                    m_waiter.reset();
+                    if (m_flush_requested.load(std::memory_order_relaxed) || m_file_writer.sync_overdue())
+                        commit(false);
+                }
                 else
-                    std::this_thread::sleep_for(std::chrono::microseconds(50));
+                {
+                    report_drops();
+                    commit(true);
+                    m_file_writer.flush_if_due();
+                    if (m_recorder)
+                        m_recorder->refresh_calibration();
+                    m_waiter.idle();
+                }
             }
 
             // Pop and log all remaining entries
             while (m_buffer_base->try_pop(logline))
             {
                 m_file_writer.write(logline);
+                m_consumed.store(m_consumed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            }
+            report_drops();
+            std::vector<std::thread::id> synced;
+            if (m_file_writer.sync_due())
+                m_file_writer.sync(synced);
+            else
+                m_file_writer.flush();
+            {
+                std::lock_guard<std::mutex> lock(m_flush_mutex);
+                for (auto const &id : synced)
+                    ++m_synced_lines[id].synced;
+                // Also releases anyone calling in after the consumer stopped.
+                m_written_through = UINT64_MAX;
+                m_synced_through = UINT64_MAX;
             }
+            m_flushed.notify_all();
         }
 
     private:
+        struct SyncedLines
+        {
+            uint64_t issued = 0;
+            uint64_t synced = 0;
+        };
+
+        // The calling thread's last line is SYNCED, returns once an fdatasync covered it.
+        void wait_for_sync()
+        {
+            uint64_t const target = m_produced.load();
+            std::thread::id const id = this_thread_id();
+            std::unique_lock<std::mutex> lock(m_flush_mutex);
+            SyncedLines &lines = m_synced_lines[id];
+            uint64_t const issued = ++lines.issued;
+            // Covers a line that was dropped, it is never counted as synced.
+            m_sync_target = std::max(m_sync_target, target);
+            m_flush_requested.store(true, std::memory_order_release);
+            m_flushed.wait(lock, [&] { return lines.synced >= issued || m_synced_through >= target; });
+            // Either way every line this thread issued was counted in the same critical section or dropped.
+            m_synced_lines.erase(id);
+        }
+
+        /*
+         * Group commit, one fdatasync for all SYNCED lines written so far. flush() callers are done
+         * once everything counted as produced when the request was seen has been consumed, checked
+         * while busy as well so a steady stream of lines cannot hold them off.
+         */
+        void commit(bool drained)
+        {
+            bool const requested = m_flush_requested.load(std::memory_order_acquire);
+            bool const sync_wanted = drained ? m_file_writer.sync_due() : m_file_writer.sync_overdue();
+            if (!requested && !sync_wanted)
+                return;
+
+            if (requested && !m_marked)
+            {
+                {
+                    std::lock_guard<std::mutex> lock(m_flush_mutex);
+                    m_marked_target = std::max(m_write_target, m_sync_target);
+                    m_marked_sync = m_sync_target > m_synced_through;
+                }
+                m_buffer_base->mark();
+                m_marked = true;
+            }
+            uint64_t const done = m_consumed.load(std::memory_order_relaxed) + m_buffer_base->drops.total();
+            // Lines already counted as produced may still be on their way into the buffer.
+            bool const caught_up = requested && done >= m_marked_target && (drained || m_buffer_base->reached_mark());
+            bool const sync = sync_wanted || (caught_up && m_marked_sync);
+            if (!sync && !caught_up)
+                return;
+
+            if (sync)
+                m_file_writer.sync(m_synced_threads);
+            else
+                m_file_writer.flush();
+            {
+                std::lock_guard<std::mutex> lock(m_flush_mutex);
+                for (auto const &id : m_synced_threads)
+                    ++m_synced_lines[id].synced;
+                if (caught_up)
+                {
+                    // A drained buffer covers requests that came in after the mark as well.
+                    uint64_t const through = drained ? done : m_marked_target;
+                    m_written_through = std::max(m_written_through, through);
+                    if (sync)
+                        m_synced_through = std::max(m_synced_through, through);
+                    if (m_write_target <= m_written_through && m_sync_target <= m_synced_through)
+                        m_flush_requested.store(false, std::memory_order_relaxed);
+                    m_marked = false;
+                }
+            }
+            m_synced_threads.clear();
+            m_flushed.notify_all();
+        }
+
+        // Called once the consumer caught up, so the gap shows up in the log next to where it happened.
+        void report_drops()
+        {
+            uint64_t first, last;
+            if (uint64_t const count = m_buffer_base->drops.take_unreported(first, last))
+                m_file_writer.write_drop_report(count, first, last);
+        }
+
+        static size_t staging_ring_capacity(uint32_t ring_buffer_size_kb)
+        {
+            // Round down to a power of two so the ring can mask instead of modulo.
+            size_t const slots = std::max(1u, ring_buffer_size_kb) * 1024 / sizeof(LLogLine);
+            size_t capacity = 16;
+            while (capacity * 2 <= slots)
+                capacity *= 2;
+            return capacity;
+        }
+
+        static size_t queue_segment_budget(uint32_t max_memory_mb)
+        {
+            if (max_memory_mb == 0)
+                return SIZE_MAX;
+            return static_cast<size_t>(max_memory_mb) * 1024 * 1024 / Buffer::memory_size;
+        }
+
+        static size_t byte_ring_capacity(uint32_t ring_buffer_size_mb)
+        {
+            size_t const bytes = static_cast<size_t>(std::max(1u, ring_buffer_size_mb)) * 1024 * 1024;
+            size_t capacity = 1024 * 1024;
+            while (capacity * 2 <= bytes)
+                capacity *= 2;
+            return capacity;
+        }
+
         enum class State
         {
             INIT,
@@ -626,6 +5275,24 @@ namespace llog
         std::atomic<State> m_state;
         std::unique_ptr<BufferBase> m_buffer_base;
         FileWriter m_file_writer;
+        ConsumerWaiter m_waiter;
+        ShardedCounter m_produced;
+        std::atomic<uint64_t> m_consumed{0};
+        std::unique_ptr<FlightRecorder> m_recorder;
+        // Produced counts flush() callers wait for and how far writes and syncs got, under m_flush_mutex.
+        std::mutex m_flush_mutex;
+        std::condition_variable m_flushed;
+        uint64_t m_write_target = 0;
+        uint64_t m_sync_target = 0;
+        uint64_t m_written_through = 0;
+        uint64_t m_synced_through = 0;
+        std::unordered_map<std::thread::id, SyncedLines> m_synced_lines;
+        std::atomic<bool> m_flush_requested{false};
+        // Consumer only.
+        std::vector<std::thread::id> m_synced_threads;
+        bool m_marked = false;
+        bool m_marked_sync = false;
+        uint64_t m_marked_target = 0;
         std::thread m_thread;
     };
 
@@ -634,27 +5301,160 @@ namespace llog
 
     bool LLog::operator==(LLogLine &logline)
     {
-        atomic_logger.load(std::memory_order_acquire)->add(std::move(logline));
+        LLogger *target = logger != nullptr ? logger->m_logger.get() : atomic_logger.load(std::memory_order_acquire);
+        target->add(std::move(logline));
         return true;
     }
 
-    void initialize(NonGuaranteedLogger ngl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb)
+    char *LLog::reserve(LogLevel level, uint32_t site_id, size_t length)
+    {
+        reserved = logger != nullptr ? logger->m_logger.get() : atomic_logger.load(std::memory_order_acquire);
+        return reserved->reserve(level, site_id, length);
+    }
+
+    void LLog::commit(char *arguments)
     {
-        llogger.reset(new LLogger(ngl, log_directory, log_file_name, log_file_roll_size_mb));
+        reserved->commit(arguments);
+    }
+
+    Logger::Logger(GuaranteedLogger gl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options)
+        : m_logger(new LLogger(gl, log_directory, log_file_name, log_file_roll_size_mb, options)), m_level(LogLevel::INFO)
+    {
+    }
+
+    Logger::Logger(NonGuaranteedLogger ngl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options)
+        : m_logger(new LLogger(ngl, log_directory, log_file_name, log_file_roll_size_mb, options)), m_level(LogLevel::INFO)
+    {
+    }
+
+    Logger::Logger(ByteRingLogger brl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options)
+        : m_logger(new LLogger(brl, log_directory, log_file_name, log_file_roll_size_mb, options)), m_level(LogLevel::INFO)
+    {
+    }
+
+    Logger::Logger(PerThreadLogger ptl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options)
+        : m_logger(new LLogger(ptl, log_directory, log_file_name, log_file_roll_size_mb, options)), m_level(LogLevel::INFO)
+    {
+    }
+
+    Logger::~Logger() = default;
+
+    LoggerStats Logger::stats()
+    {
+        return m_logger->stats();
+    }
+
+    void Logger::flush(Durability durability)
+    {
+        m_logger->flush(durability);
+    }
+
+    void initialize(NonGuaranteedLogger ngl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options)
+    {
+        llogger.reset(new LLogger(ngl, log_directory, log_file_name, log_file_roll_size_mb, options));
+        atomic_logger.store(llogger.get(), std::memory_order_seq_cst);
+    }
+
+    void initialize(ByteRingLogger brl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options)
+    {
+        llogger.reset(new LLogger(brl, log_directory, log_file_name, log_file_roll_size_mb, options));
+        atomic_logger.store(llogger.get(), std::memory_order_seq_cst);
+    }
+
+    void initialize(PerThreadLogger ptl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options)
+    {
+        llogger.reset(new LLogger(ptl, log_directory, log_file_name, log_file_roll_size_mb, options));
         atomic_logger.store(llogger.get(), std::memory_order_seq_cst);
     }
 
-    void initialize(GuaranteedLogger gl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb)
+    void initialize(GuaranteedLogger gl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options)
     {
-        llogger.reset(new LLogger(gl, log_directory, log_file_name, log_file_roll_size_mb));
+        llogger.reset(new LLogger(gl, log_directory, log_file_name, log_file_roll_size_mb, options));
         atomic_logger.store(llogger.get(), std::memory_order_seq_cst);
     }
 
-    std::atomic<unsigned int> loglevel{0};
+    LoggerStats stats()
+    {
+        LLogger *logger = atomic_logger.load(std::memory_order_acquire);
+        return logger != nullptr ? logger->stats() : LoggerStats();
+    }
+
+    void flush(Durability durability)
+    {
+        LLogger *logger = atomic_logger.load(std::memory_order_acquire);
+        if (logger != nullptr)
+            logger->flush(durability);
+    }
+
+    uint64_t coarse_milliseconds()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+    }
+
+    std::atomic<unsigned int> loglevel{static_cast<unsigned int>(LogLevel::INFO)};
+
+    std::atomic<uint32_t> level_generation{2};
+
+    std::mutex module_levels_mutex;
+    std::vector<std::pair<std::string, LogLevel>> module_levels;
+
+    // Call with the new thresholds in place, sites that cached the old generation re-evaluate.
+    void bump_level_generation()
+    {
+        level_generation.fetch_add(2, std::memory_order_release);
+    }
 
     void set_log_level(LogLevel level)
     {
         loglevel.store(static_cast<unsigned int>(level), std::memory_order_release);
+        bump_level_generation();
+    }
+
+    void set_module_log_level(std::string const &module, LogLevel level)
+    {
+        {
+            std::lock_guard<std::mutex> lock(module_levels_mutex);
+            auto it = std::find_if(module_levels.begin(), module_levels.end(),
+                                   [&](std::pair<std::string, LogLevel> const &entry) { return entry.first == module; });
+            if (it != module_levels.end())
+                it->second = level;
+            else
+                module_levels.emplace_back(module, level);
+        }
+        bump_level_generation();
+    }
+
+    void clear_module_log_levels()
+    {
+        {
+            std::lock_guard<std::mutex> lock(module_levels_mutex);
+            module_levels.clear();
+        }
+        bump_level_generation();
+    }
+
+    bool refresh_site_enabled(std::atomic<uint32_t> &state, char const *file, LogLevel level)
+    {
+        // Generation first, so thresholds changed meanwhile leave the cache stale rather than wrong.
+        uint32_t const generation = level_generation.load(std::memory_order_acquire);
+        unsigned int threshold = loglevel.load(std::memory_order_relaxed);
+        {
+            std::lock_guard<std::mutex> lock(module_levels_mutex);
+            size_t longest = 0;
+            for (auto const &entry : module_levels)
+            {
+                if (entry.first.size() > longest && strstr(file, entry.first.c_str()) != nullptr)
+                {
+                    longest = entry.first.size();
+                    threshold = static_cast<unsigned int>(entry.second);
+                }
+            }
+        }
+        bool const enabled = static_cast<unsigned int>(level) >= threshold;
+        state.store(generation | (enabled ? 1 : 0), std::memory_order_relaxed);
+        return enabled;
     }
 
     bool is_logged(LogLevel level)
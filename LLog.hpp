@@ -1,23 +1,153 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
+#include <cstring>
 #include <memory>
 #include <string>
 #include <iosfwd>
+#include <tuple>
 #include <type_traits>
+#include <vector>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 
 namespace llog
 {
     enum class LogLevel : uint8_t
     {
+        TRACE,
+        DEBUG,
         INFO,
         WARN,
         CRIT
     };
 
+    constexpr size_t log_level_count = 5;
+
+    struct LogSite
+    {
+        char const *file;
+        char const *function;
+        uint32_t line;
+        LogLevel level;
+        // Argument types of the statement when known at compile time, otherwise nullptr.
+        char const *signature;
+    };
+
+    /*
+     * Registers a call site once and returns the compact id loglines carry instead of
+     * file, function and line. Registering the same site again returns the same id.
+     */
+    uint32_t register_site(char const *file, char const *function, uint32_t line, LogLevel level, char const *signature = nullptr);
+
+    // Raw bytes copied into the logline and hex dumped by the consumer, see hex().
+    struct Hex
+    {
+        void const *data;
+        uint32_t length;
+    };
+
+    // LOG_INFO << llog::hex(packet, size), written as "0a 1b 2c". Dumps of more than 4GB are cut.
+    inline Hex hex(void const *data, size_t length)
+    {
+        return Hex{data, static_cast<uint32_t>(length < UINT32_MAX ? length : UINT32_MAX)};
+    }
+
+    // Statements a rate-limited call site skipped before this one, written as "[N suppressed] " when not zero.
+    struct Suppressed
+    {
+        uint64_t count;
+    };
+
+    // A named value, see kv().
+    template <typename T>
+    struct KeyValue
+    {
+        char const *key;
+        T const &value;
+    };
+
+    /*
+     * LOG_INFO << llog::kv("order_id", id) << llog::kv("px", price). The key must be a literal and is
+     * stored by reference, the value keeps its own type. LogFormat::JSON and LOGFMT render these as
+     * fields, TEXT as " key=value".
+     */
+    template <size_t N, typename T>
+    KeyValue<T> kv(char const (&key)[N], T const &value)
+    {
+        return KeyValue<T>{key, value};
+    }
+
+    class BinaryCodec;
+    class ByteRing;
+    class FlightRecorder;
+    class LineFormatter;
+
+    // Where LogTraits::format writes, a view of the consumer's line buffer.
+    class TextWriter
+    {
+    public:
+        explicit TextWriter(LineFormatter &formatter) : m_formatter(formatter) {}
+
+        void append(char c);
+        void append(char const *s, size_t length);
+        void append(char const *s);
+        void append_signed(int64_t value);
+        void append_unsigned(uint64_t value);
+        void append_double(double value);
+
+    private:
+        LineFormatter &m_formatter;
+    };
+
+    /*
+     * Specialise to log a type by copying its state now and formatting it on the background thread:
+     *
+     *   template <> struct llog::LogTraits<Endpoint>
+     *   {
+     *       static size_t size(Endpoint const &e);                                   // bytes encode writes
+     *       static void encode(Endpoint const &e, char *out);                       // unaligned, memcpy
+     *       static void format(char const *in, size_t size, llog::TextWriter &out); // background thread
+     *   };
+     *
+     * Binary logs and sinks store the formatted text, the flight recorder stores a hex dump.
+     */
+    template <typename T, typename Enable = void>
+    struct LogTraits
+    {
+    };
+
+    template <typename T>
+    class has_log_traits
+    {
+        template <typename U>
+        static char test(decltype(&LogTraits<U>::format));
+        template <typename U>
+        static long test(...);
+
+    public:
+        static constexpr bool value = sizeof(test<T>(nullptr)) == sizeof(char);
+    };
+
+    typedef void (*UserFormat)(char const *data, size_t size, TextWriter &out);
+
+    // Process-local id the consumer finds format by, UINT32_MAX when the table is full.
+    uint32_t register_user_format(UserFormat format);
+
+    template <typename T>
+    uint32_t user_format_id()
+    {
+        static uint32_t const id = register_user_format(&LogTraits<T>::format);
+        return id;
+    }
+
     class LLogLine
     {
     public:
+        LLogLine(LogLevel level, uint32_t site_id);
+        // Looks the site up on every call, LLOG registers it once per call site instead.
         LLogLine(LogLevel level, const char *file, const char *function, uint32_t line);
         ~LLogLine();
 
@@ -26,13 +156,53 @@ namespace llog
 
         void stringify(std::ostream &os);
 
+        uint64_t timestamp() const;
+
         LLogLine &operator<<(char arg);
+        LLogLine &operator<<(bool arg);
+        LLogLine &operator<<(int8_t arg);
+        LLogLine &operator<<(uint8_t arg);
+        LLogLine &operator<<(int16_t arg);
+        LLogLine &operator<<(uint16_t arg);
         LLogLine &operator<<(int32_t arg);
         LLogLine &operator<<(uint32_t arg);
         LLogLine &operator<<(int64_t arg);
         LLogLine &operator<<(uint64_t arg);
+        LLogLine &operator<<(float arg);
         LLogLine &operator<<(double arg);
+        // Length-prefixed, the consumer needs no strlen.
         LLogLine &operator<<(const std::string &arg);
+#if __cplusplus >= 201703L
+        LLogLine &operator<<(std::string_view arg);
+#endif
+        LLogLine &operator<<(Hex arg);
+        LLogLine &operator<<(Suppressed arg);
+
+        // Written as "0x..." like %p. char pointers are strings, see below.
+        template <typename T>
+        typename std::enable_if<!std::is_same<typename std::remove_cv<T>::type, char>::value, LLogLine &>::type
+        operator<<(T *arg)
+        {
+            encode_pointer(arg);
+            return *this;
+        }
+
+        // As the underlying integer.
+        template <typename T>
+        typename std::enable_if<std::is_enum<T>::value && !has_log_traits<T>::value, LLogLine &>::type
+        operator<<(T arg)
+        {
+            return *this << static_cast<typename std::underlying_type<T>::type>(arg);
+        }
+
+        template <typename T>
+        typename std::enable_if<has_log_traits<T>::value, LLogLine &>::type
+        operator<<(T const &arg)
+        {
+            size_t const size = LogTraits<T>::size(arg);
+            LogTraits<T>::encode(arg, reserve_user_type(user_format_id<T>(), size));
+            return *this;
+        }
 
         template <size_t N>
         LLogLine &operator<<(const char (&arg)[N])
@@ -41,6 +211,22 @@ namespace llog
             return *this;
         }
 
+        /*
+         * The whole statement in one pass, see LLOG_V. The size of fixed-size arguments is known
+         * at compile time and the buffer is checked once. Strings are always encoded, even empty.
+         */
+        template <typename... Args>
+        LLogLine &write(Args const &... args);
+
+        template <typename T>
+        LLogLine &operator<<(KeyValue<T> const &field)
+        {
+            size_t const used = begin_field(field.key);
+            *this << field.value;
+            end_field(used);
+            return *this;
+        }
+
         template <typename Arg>
         typename std::enable_if<std::is_same<Arg, const char *>::value, LLogLine &>::type
         operator<<(Arg const &arg)
@@ -64,7 +250,33 @@ namespace llog
             char const *m_s;
         };
 
+        struct field_name_t
+        {
+            explicit field_name_t(char const *s) : m_s(s) {}
+
+            char const *m_s;
+        };
+
+        // Tags of u32 length-prefixed payloads, the types only name them in SupportedTypes.
+        struct sized_string_t
+        {
+        };
+
+        struct hex_dump_t
+        {
+        };
+
+        // A LogTraits type, u32 format id, u32 length and the encoded state.
+        struct user_type_t
+        {
+        };
+
     private:
+        friend class BinaryCodec;
+        friend class ByteRing;
+        friend class FlightRecorder;
+        friend class LineFormatter;
+
         char *buffer();
 
         template <typename Arg>
@@ -77,8 +289,12 @@ namespace llog
         void encode(char const *arg);
         void encode(string_literal_t arg);
         void encode_c_string(char const *arg, size_t length);
+        void encode_sized(uint8_t type_id, void const *data, uint32_t length);
+        void encode_pointer(void const *arg);
+        char *reserve_user_type(uint32_t format_id, size_t size);
+        size_t begin_field(char const *key);
+        void end_field(size_t used);
         void resize_buffer_if_needed(size_t additional_bytes);
-        void stringify(std::ostream &os, char *state, char const *const end);
 
     private:
         size_t m_bytes_used;
@@ -87,27 +303,774 @@ namespace llog
         char m_stack_buffer[256 - 2 * sizeof(size_t) - sizeof(decltype(m_heap_buffer)) - 8];
     };
 
+    template <typename T, typename Tuple>
+    struct TupleIndex;
+
+    template <typename T, typename... Types>
+    struct TupleIndex<T, std::tuple<T, Types...>>
+    {
+        static constexpr const std::size_t value = 0;
+    };
+
+    template <typename T, typename U, typename... Types>
+    struct TupleIndex<T, std::tuple<U, Types...>>
+    {
+        static constexpr const std::size_t value = 1 + TupleIndex<T, std::tuple<Types...>>::value;
+    };
+
+    // An argument is encoded as a u8 index into this tuple followed by its payload.
+    typedef std::tuple<char, uint32_t, uint64_t, int32_t, int64_t, double, LLogLine::string_literal_t, char *, LLogLine::field_name_t,
+                       bool, int8_t, uint8_t, int16_t, uint16_t, float, void const *, LLogLine::sized_string_t, LLogLine::hex_dump_t,
+                       LLogLine::user_type_t>
+        SupportedTypes;
+
+    namespace detail
+    {
+        // Picks the type a number is stored as, by the same overload resolution as LLogLine::operator<<.
+        char stored_as(char);
+        bool stored_as(bool);
+        int8_t stored_as(int8_t);
+        uint8_t stored_as(uint8_t);
+        int16_t stored_as(int16_t);
+        uint16_t stored_as(uint16_t);
+        int32_t stored_as(int32_t);
+        uint32_t stored_as(uint32_t);
+        int64_t stored_as(int64_t);
+        uint64_t stored_as(uint64_t);
+        float stored_as(float);
+        double stored_as(double);
+
+        // How LLogLine::write encodes one argument: the bytes it needs and the store.
+        template <typename T, typename Enable = void>
+        struct Encoding
+        {
+            typedef decltype(stored_as(std::declval<T>())) Stored;
+            static constexpr uint8_t tag = TupleIndex<Stored, SupportedTypes>::value;
+            static constexpr size_t fixed_size = 1 + sizeof(Stored);
+
+            static size_t variable_size(T const &)
+            {
+                return 0;
+            }
+
+            static char *store(char *b, T const &arg, size_t)
+            {
+                Stored const value = arg;
+                *b = static_cast<char>(tag);
+                memcpy(b + 1, &value, sizeof(value));
+                return b + fixed_size;
+            }
+        };
+
+        template <size_t N>
+        struct Encoding<char[N]>
+        {
+            static constexpr uint8_t tag = TupleIndex<LLogLine::string_literal_t, SupportedTypes>::value;
+            static constexpr size_t fixed_size = 1 + sizeof(char const *);
+
+            static size_t variable_size(char const (&)[N])
+            {
+                return 0;
+            }
+
+            static char *store(char *b, char const (&arg)[N], size_t)
+            {
+                char const *const literal = arg;
+                *b = static_cast<char>(tag);
+                memcpy(b + 1, &literal, sizeof(literal));
+                return b + fixed_size;
+            }
+        };
+
+        template <typename T>
+        struct Encoding<T, typename std::enable_if<std::is_enum<T>::value && !has_log_traits<T>::value>::type>
+        {
+            typedef Encoding<typename std::underlying_type<T>::type> Underlying;
+            static constexpr uint8_t tag = Underlying::tag;
+            static constexpr size_t fixed_size = Underlying::fixed_size;
+
+            static size_t variable_size(T const &)
+            {
+                return 0;
+            }
+
+            static char *store(char *b, T const &arg, size_t length)
+            {
+                return Underlying::store(b, static_cast<typename std::underlying_type<T>::type>(arg), length);
+            }
+        };
+
+        template <typename T>
+        struct Encoding<T *, typename std::enable_if<!std::is_same<typename std::remove_cv<T>::type, char>::value>::type>
+        {
+            static constexpr uint8_t tag = TupleIndex<void const *, SupportedTypes>::value;
+            static constexpr size_t fixed_size = 1 + sizeof(void const *);
+
+            static size_t variable_size(T *)
+            {
+                return 0;
+            }
+
+            static char *store(char *b, T *arg, size_t)
+            {
+                void const *const pointer = arg;
+                *b = static_cast<char>(tag);
+                memcpy(b + 1, &pointer, sizeof(pointer));
+                return b + fixed_size;
+            }
+        };
+
+        template <typename T>
+        struct Encoding<T, typename std::enable_if<has_log_traits<T>::value>::type>
+        {
+            static constexpr uint8_t tag = TupleIndex<LLogLine::user_type_t, SupportedTypes>::value;
+            static constexpr size_t fixed_size = 1 + 2 * sizeof(uint32_t);
+
+            static size_t variable_size(T const &arg)
+            {
+                return LogTraits<T>::size(arg);
+            }
+
+            static char *store(char *b, T const &arg, size_t length)
+            {
+                uint32_t const header[2] = {user_format_id<T>(), static_cast<uint32_t>(length)};
+                *b = static_cast<char>(tag);
+                memcpy(b + 1, header, sizeof(header));
+                LogTraits<T>::encode(arg, b + fixed_size);
+                return b + fixed_size + length;
+            }
+        };
+
+        // A u32 length and the bytes.
+        template <typename Tag>
+        struct SizedEncoding
+        {
+            static constexpr uint8_t tag = TupleIndex<Tag, SupportedTypes>::value;
+            static constexpr size_t fixed_size = 1 + sizeof(uint32_t);
+
+            static char *store(char *b, void const *data, size_t length)
+            {
+                uint32_t const size = static_cast<uint32_t>(length);
+                *b = static_cast<char>(tag);
+                memcpy(b + 1, &size, sizeof(size));
+                if (length != 0)
+                    memcpy(b + fixed_size, data, length);
+                return b + fixed_size + length;
+            }
+        };
+
+        template <>
+        struct Encoding<Hex> : SizedEncoding<LLogLine::hex_dump_t>
+        {
+            static size_t variable_size(Hex const &arg)
+            {
+                return arg.length;
+            }
+
+            static char *store(char *b, Hex const &arg, size_t length)
+            {
+                return SizedEncoding::store(b, arg.data, length);
+            }
+        };
+
+        struct CStringEncoding
+        {
+            static constexpr uint8_t tag = TupleIndex<char *, SupportedTypes>::value;
+            // The tag and the terminating zero.
+            static constexpr size_t fixed_size = 2;
+
+            static char *store(char *b, char const *arg, size_t length)
+            {
+                *b = static_cast<char>(tag);
+                if (length != 0)
+                    memcpy(b + 1, arg, length);
+                b[1 + length] = '\0';
+                return b + fixed_size + length;
+            }
+        };
+
+        template <>
+        struct Encoding<char const *> : CStringEncoding
+        {
+            static size_t variable_size(char const *arg)
+            {
+                return arg != nullptr ? strlen(arg) : 0;
+            }
+        };
+
+        template <>
+        struct Encoding<char *> : Encoding<char const *>
+        {
+        };
+
+        template <>
+        struct Encoding<std::string> : SizedEncoding<LLogLine::sized_string_t>
+        {
+            static size_t variable_size(std::string const &arg)
+            {
+                return arg.size() < UINT32_MAX ? arg.size() : UINT32_MAX;
+            }
+
+            static char *store(char *b, std::string const &arg, size_t length)
+            {
+                return SizedEncoding::store(b, arg.data(), length);
+            }
+        };
+
+#if __cplusplus >= 201703L
+        template <>
+        struct Encoding<std::string_view> : SizedEncoding<LLogLine::sized_string_t>
+        {
+            static size_t variable_size(std::string_view const &arg)
+            {
+                return arg.size() < UINT32_MAX ? arg.size() : UINT32_MAX;
+            }
+
+            static char *store(char *b, std::string_view const &arg, size_t length)
+            {
+                return SizedEncoding::store(b, arg.data(), length);
+            }
+        };
+#endif
+
+        template <typename T>
+        struct Encoding<KeyValue<T>>
+        {
+            static constexpr uint8_t tag = TupleIndex<LLogLine::field_name_t, SupportedTypes>::value;
+            static constexpr size_t fixed_size = 1 + sizeof(char const *) + Encoding<T>::fixed_size;
+
+            static size_t variable_size(KeyValue<T> const &arg)
+            {
+                return Encoding<T>::variable_size(arg.value);
+            }
+
+            static char *store(char *b, KeyValue<T> const &arg, size_t length)
+            {
+                *b = static_cast<char>(tag);
+                memcpy(b + 1, &arg.key, sizeof(arg.key));
+                return Encoding<T>::store(b + 1 + sizeof(arg.key), arg.value, length);
+            }
+        };
+
+        template <typename... Args>
+        struct FixedSize;
+
+        template <>
+        struct FixedSize<>
+        {
+            static constexpr size_t value = 0;
+        };
+
+        template <typename T, typename... Args>
+        struct FixedSize<T, Args...>
+        {
+            static constexpr size_t value = Encoding<T>::fixed_size + FixedSize<Args...>::value;
+        };
+
+        // One tag per argument, as digits from '0', for LogSite::signature.
+        template <typename... Args>
+        struct Signature
+        {
+            static constexpr char value[] = {static_cast<char>('0' + Encoding<Args>::tag)..., '\0'};
+        };
+
+        template <typename... Args>
+        constexpr char Signature<Args...>::value[];
+
+        // Only named in decltype, never called.
+        template <typename... Args>
+        Signature<Args...> signature_of(Args const &...);
+
+        // The bytes the arguments take, lengths[1..] receive their variable sizes.
+        template <typename... Args>
+        size_t encoded_size(size_t (&lengths)[sizeof...(Args) + 1], Args const &... args)
+        {
+            // Leading zero keeps the array non-empty for a statement without arguments.
+            size_t const sizes[] = {0, Encoding<Args>::variable_size(args)...};
+            size_t total = FixedSize<Args...>::value;
+            for (size_t i = 0; i < sizeof...(Args) + 1; ++i)
+                total += lengths[i] = sizes[i];
+            return total;
+        }
+
+        template <typename... Args>
+        void store_all(char *b, size_t const *length, Args const &... args)
+        {
+            char *const stores[] = {b, (b = Encoding<Args>::store(b, args, *++length))...};
+            (void)stores;
+        }
+    } // namespace detail
+
+    template <typename... Args>
+    LLogLine &LLogLine::write(Args const &... args)
+    {
+        size_t lengths[sizeof...(Args) + 1];
+        size_t const total = detail::encoded_size(lengths, args...);
+        resize_buffer_if_needed(total);
+        detail::store_all(buffer(), lengths, args...);
+        m_bytes_used += total;
+        return *this;
+    }
+
+    class Logger;
+    class LLogger;
+
     struct LLog
     {
+        // The global logger.
+        LLog() : logger(nullptr), reserved(nullptr) {}
+        explicit LLog(Logger &target) : logger(&target), reserved(nullptr) {}
+
         bool operator==(LLogLine &);
+
+        /*
+         * Space for a line whose arguments take length bytes, with the line header already written,
+         * or nullptr when the logger only takes LLogLines. Publish the arguments with commit().
+         */
+        char *reserve(LogLevel level, uint32_t site_id, size_t length);
+        void commit(char *arguments);
+
+        Logger *logger;
+        // Where reserve() took the space from.
+        LLogger *reserved;
     };
 
+    // An LLOG_V statement, encoded in place into a ByteRingLogger's ring and into an LLogLine otherwise.
+    struct DirectLine
+    {
+        LLog log;
+        LogLevel level;
+        uint32_t site_id;
+
+        template <typename... Args>
+        bool write(Args const &... args)
+        {
+            size_t lengths[sizeof...(Args) + 1];
+            size_t const total = detail::encoded_size(lengths, args...);
+            char *const b = log.reserve(level, site_id, total);
+            if (b == nullptr)
+                return log == LLogLine(level, site_id).write(args...);
+            detail::store_all(b, lengths, args...);
+            log.commit(b);
+            return true;
+        }
+    };
+
+    uint64_t coarse_milliseconds();
+
+    // Handed from a rate-limited call site's check to the line it lets through on the same thread.
+    inline uint64_t &pending_suppressed()
+    {
+        static thread_local uint64_t count = 0;
+        return count;
+    }
+
+    inline uint64_t take_suppressed()
+    {
+        uint64_t const count = pending_suppressed();
+        pending_suppressed() = 0;
+        return count;
+    }
+
+    /*
+     * State of one rate-limited call site on one thread, so checks never contend.
+     * Lives in thread_local storage, which starts zeroed.
+     */
+    struct RateLimiter
+    {
+        uint64_t count;
+        uint64_t suppressed;
+        // Next allowed time for every_ms, random state for sampled.
+        uint64_t next;
+
+        bool every_n(uint64_t n)
+        {
+            return count++ % (n != 0 ? n : 1) == 0 ? pass() : skip();
+        }
+
+        bool first_n(uint64_t n)
+        {
+            return count < n ? (++count, pass()) : skip();
+        }
+
+        bool every_ms(uint64_t ms)
+        {
+            uint64_t const now = coarse_milliseconds();
+            if (now < next)
+                return skip();
+            next = now + ms;
+            return pass();
+        }
+
+        bool sampled(double probability)
+        {
+            // xorshift64, seeded from the address, which differs per thread.
+            uint64_t x = next != 0 ? next : reinterpret_cast<uintptr_t>(this) | 1;
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            next = x;
+            return static_cast<double>(x >> 11) * (1.0 / 9007199254740992.0) < probability ? pass() : skip();
+        }
+
+        bool pass()
+        {
+            pending_suppressed() = suppressed;
+            suppressed = 0;
+            return true;
+        }
+
+        bool skip()
+        {
+            ++suppressed;
+            return false;
+        }
+    };
+
+    // Default threshold for files without a module level. Statements below LLOG_MIN_LEVEL are compiled out regardless.
     void set_log_level(LogLevel level);
 
+    /*
+     * Threshold for every source file whose __FILE__ contains module, e.g. "net/" or "parser.cpp".
+     * The longest matching module wins. Takes effect live, call sites pick it up on their next statement.
+     */
+    void set_module_log_level(std::string const &module, LogLevel level);
+    void clear_module_log_levels();
+
+    /*
+     * Bumped by two on every level change. A call site caches generation | enabled for each level,
+     * so a statement whose level is only known at runtime gets the decision for that level.
+     */
+    extern std::atomic<uint32_t> level_generation;
+
+    bool refresh_site_enabled(std::atomic<uint32_t> &state, char const *file, LogLevel level);
+
+    // One XOR and one predictable branch while the site is up to date, a constant level folds the index.
+    inline bool site_enabled(std::atomic<uint32_t> (&states)[log_level_count], char const *file, LogLevel level)
+    {
+        std::atomic<uint32_t> &state = states[static_cast<size_t>(level)];
+        uint32_t const stale = state.load(std::memory_order_relaxed) ^ level_generation.load(std::memory_order_relaxed);
+        if (stale <= 1)
+            return stale != 0;
+        return refresh_site_enabled(state, file, level);
+    }
+
+    // Takes an int so LLOG_MIN_LEVEL 0 does not compare an unsigned level against zero.
+    template <int MIN_LEVEL>
+    constexpr bool compiled_in(int level)
+    {
+        return level >= MIN_LEVEL;
+    }
+
+    enum class ClockSource : uint8_t
+    {
+        // Wall clock read on every log statement, microsecond resolution.
+        SYSTEM,
+        // Raw rdtsc on the producer, converted to nanosecond wall-clock time by the background thread.
+        // Falls back to CLOCK_MONOTONIC_RAW when the TSC is not invariant.
+        TSC
+    };
+
+    // Process wide, call before initialize() and before the first log statement.
+    void set_clock_source(ClockSource source);
+
     bool is_logged(LogLevel level);
 
+    // What a NonGuaranteedLogger does with a line that does not fit into its full ring.
+    enum class OverflowPolicy : uint8_t
+    {
+        // Discard the oldest unread line to make room.
+        DROP_OLDEST,
+        // Discard the new line, the producer never waits.
+        DROP_NEWEST,
+        // Wait up to block_timeout_us for the background thread to free a slot, then discard the new line.
+        BLOCK,
+        // Queue the line in an overflow segment as large as the ring, discard it once that is full too.
+        SPILL
+    };
+
+    /*
+     * Lines go to a fixed ring of ring_buffer_size_mb. Lines lost to overflow_policy are counted
+     * in stats() and reported in the log once the background thread catches up.
+     */
     struct NonGuaranteedLogger
     {
-        NonGuaranteedLogger(uint32_t ring_buffer_size_mb_) : ring_buffer_size_mb(ring_buffer_size_mb_) {}
+        NonGuaranteedLogger(uint32_t ring_buffer_size_mb_, OverflowPolicy overflow_policy_ = OverflowPolicy::DROP_OLDEST, uint32_t block_timeout_us_ = 1000)
+            : ring_buffer_size_mb(ring_buffer_size_mb_), overflow_policy(overflow_policy_), block_timeout_us(block_timeout_us_) {}
         uint32_t ring_buffer_size_mb;
+        OverflowPolicy overflow_policy;
+        uint32_t block_timeout_us;
     };
 
+    /*
+     * Never drops a line. Lines go to 8 MB segments taken from a pool of preallocated_segments
+     * that are allocated and pre-faulted up front and recycled once drained. The background thread
+     * allocates more ahead of need up to max_memory_mb (0 is unlimited). Producers never allocate,
+     * they block until a segment is available.
+     */
     struct GuaranteedLogger
     {
+        GuaranteedLogger(uint32_t preallocated_segments_ = 2, uint32_t max_memory_mb_ = 256)
+            : preallocated_segments(preallocated_segments_), max_memory_mb(max_memory_mb_) {}
+        uint32_t preallocated_segments;
+        uint32_t max_memory_mb;
+    };
+
+    /*
+     * Every producer thread lazily gets its own single-producer/single-consumer ring
+     * of ring_buffer_size_kb, so producers never contend with each other.
+     * The background thread merges all rings by timestamp. A full ring drops the new line.
+     */
+    struct PerThreadLogger
+    {
+        PerThreadLogger(uint32_t ring_buffer_size_kb_) : ring_buffer_size_kb(ring_buffer_size_kb_) {}
+        uint32_t ring_buffer_size_kb;
     };
 
-    void initialize(GuaranteedLogger gl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb);
-    void initialize(NonGuaranteedLogger ngl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb);
+    /*
+     * Lines are copied into one byte ring of ring_buffer_size_mb as variable-length records,
+     * and a short line takes less than a slot. LLOG_V encodes straight into the ring, so a line
+     * of any length takes one copy and no allocation. Producers wait for space when the ring is full.
+     */
+    struct ByteRingLogger
+    {
+        ByteRingLogger(uint32_t ring_buffer_size_mb_) : ring_buffer_size_mb(ring_buffer_size_mb_) {}
+        uint32_t ring_buffer_size_mb;
+    };
+
+    enum class LogFormat : uint8_t
+    {
+        TEXT,
+        // Encoded loglines framed with a per-file string table, see llog-decode.
+        BINARY,
+        // One object per line with time, level, thread, file, function, line, msg and the kv() fields.
+        JSON,
+        // The same keys as JSON, key=value separated by spaces.
+        LOGFMT
+    };
+
+    // How the background thread hands blocks to the log file.
+    enum class IoBackend : uint8_t
+    {
+        // write() through the page cache, the consumer stalls when writeback does.
+        BUFFERED,
+        /*
+         * Aligned blocks submitted through io_uring, with O_DIRECT where the filesystem allows it.
+         * Several blocks stay in flight while the consumer formats the next one. Each file is
+         * fallocated to log_file_roll_size_mb when opened and truncated to its length on roll.
+         * Falls back to BUFFERED when io_uring is not available.
+         */
+        IO_URING
+    };
+
+    // Rolling by time on top of log_file_roll_size_mb, at UTC hour or day boundaries.
+    enum class Rotation : uint8_t
+    {
+        // Files are named name.N.ext.
+        NONE,
+        // Files are named name.YYYYmmdd-HHMMSS.N.ext after the time of their first line.
+        HOURLY,
+        DAILY
+    };
+
+    // Compression of log files into frames of a built-in LZ codec, read back with decompress_log.
+    enum class Compression : uint8_t
+    {
+        NONE,
+        // Each file is compressed to its name plus .lz on a low-priority helper thread once it rolled.
+        ROLLED,
+        // The consumer compresses each block as it writes it, files are named with .lz. Uses BUFFERED I/O.
+        STREAMING
+    };
+
+    // What the consumer does for a line once it wrote it into the block, per level.
+    enum class Durability : uint8_t
+    {
+        // Nothing, the block goes out when full or after flush_interval_ms.
+        NONE,
+        // The block is written at once, the line survives the process crashing.
+        WRITTEN,
+        /*
+         * Also fdatasync, the line survives the machine crashing. The logging thread waits for it,
+         * lines logged while an fdatasync is running share the next one.
+         */
+        SYNCED
+    };
+
+    // How the background thread waits for new lines when the buffer is empty.
+    enum class WaitStrategy : uint8_t
+    {
+        // Spin with pause, lowest latency, burns a core.
+        BUSY_SPIN,
+        // Spin for a while, then yield the core to other runnable threads.
+        SPIN_YIELD,
+        // Spin, yield, then sleep with exponential backoff up to max_backoff_us.
+        BACKOFF,
+        // Spin, then park on a futex. Producers wake the consumer only when it is parked.
+        BLOCKING
+    };
+
+    /*
+     * Destination the background thread sends records to next to the log file. Records below
+     * min_level never reach the sink, and each record is formatted at most once per format
+     * however many sinks take it. Binary records refer to strings defined earlier in the same
+     * stream, so binary sinks are encoded one by one.
+     */
+    class Sink
+    {
+    public:
+        Sink(LogLevel min_level, LogFormat format) : m_min_level(min_level), m_format(format) {}
+        virtual ~Sink() = default;
+
+        // One or more complete records. Returning false means the data was lost and the stream starts over,
+        // a binary sink then gets a fresh header before the next record.
+        virtual bool write(char const *data, size_t length, LogLevel level) = 0;
+        virtual void flush() {}
+
+        LogLevel min_level() const { return m_min_level; }
+        LogFormat format() const { return m_format; }
+
+    private:
+        LogLevel const m_min_level;
+        LogFormat const m_format;
+    };
+
+    std::shared_ptr<Sink> make_stderr_sink(LogLevel min_level = LogLevel::WARN);
+
+    // Stream socket to a local collector. Connects lazily, retries at most once a second and drops records while it is away.
+    std::shared_ptr<Sink> make_unix_socket_sink(std::string const &path, LogLevel min_level = LogLevel::CRIT, LogFormat format = LogFormat::TEXT);
+
+    struct LoggerOptions
+    {
+        LogFormat format = LogFormat::TEXT;
+        // Lines below this level are kept out of the log file, sinks have their own threshold.
+        LogLevel file_min_level = LogLevel::TRACE;
+        std::vector<std::shared_ptr<Sink>> sinks;
+        // Records are collected in blocks of this size and written with one syscall per block.
+        uint32_t write_block_size_kb = 1024;
+        // Upper bound on how long a partially filled block waits.
+        uint32_t flush_interval_ms = 50;
+        // Indexed by LogLevel, CRIT lines are flushed at once.
+        Durability durability[5] = {Durability::NONE, Durability::NONE, Durability::NONE, Durability::NONE, Durability::WRITTEN};
+        // Longest a SYNCED line waits for the consumer to run dry before its fdatasync is issued anyway.
+        uint32_t group_commit_us = 1000;
+        IoBackend io_backend = IoBackend::BUFFERED;
+        // IO_URING only, blocks of write_block_size_kb in flight at once.
+        uint32_t io_queue_depth = 4;
+        Rotation rotation = Rotation::NONE;
+        /*
+         * Retention, 0 for no limit. A helper thread deletes the oldest rolled files beyond
+         * max_files or max_total_mb. With a rotation this includes files of earlier runs.
+         */
+        uint32_t max_files = 0;
+        uint32_t max_total_mb = 0;
+        Compression compression = Compression::NONE;
+        // Share of one core compression may use, ROLLED sleeps to stay below it, STREAMING stores blocks uncompressed past it.
+        uint32_t compression_cpu_percent = 25;
+        WaitStrategy wait_strategy = WaitStrategy::BACKOFF;
+        uint32_t max_backoff_us = 1000;
+        // Producers also copy every record into a ring in a memory-mapped file at this path, e.g. under /dev/shm,
+        // which outlives a crash and is read back with llog-recover. Empty disables it. Removed on clean shutdown.
+        std::string flight_recorder_path;
+        uint32_t flight_recorder_size_kb = 4096;
+        // A fatal signal copies the mapped file here before the process dies, empty installs no handler.
+        std::string flight_recorder_dump_path;
+    };
+
+    void initialize(GuaranteedLogger gl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options = LoggerOptions());
+    void initialize(NonGuaranteedLogger ngl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options = LoggerOptions());
+    void initialize(ByteRingLogger brl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options = LoggerOptions());
+    void initialize(PerThreadLogger ptl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options = LoggerOptions());
+
+    struct LoggerStats
+    {
+        // Records handed to the logger, written by the background thread and lost to a full buffer.
+        uint64_t produced = 0;
+        uint64_t consumed = 0;
+        uint64_t dropped = 0;
+        // Records waiting for the background thread.
+        uint64_t pending = 0;
+        // Queue segments in guaranteed mode, producer rings in per thread mode, otherwise 1.
+        uint64_t segments = 0;
+        // Now minus the timestamp of the last record the background thread took, 0 when nothing is pending.
+        uint64_t consumer_lag_ns = 0;
+        uint64_t bytes_written = 0;
+        uint64_t file_rolls = 0;
+        // Bucket i counts writes of a single record that took [2^i, 2^(i+1)) nanoseconds.
+        static constexpr size_t write_time_buckets = 32;
+        uint64_t write_time_ns[write_time_buckets] = {};
+    };
+
+    // Snapshot of the current logger's counters, all zero before initialize(). Cheap enough to scrape periodically.
+    LoggerStats stats();
+
+    /*
+     * Blocks until every line logged before the call is in the file, written or with SYNCED also
+     * fdatasync'd. Concurrent callers share the work. Does nothing before initialize().
+     */
+    void flush(Durability durability = Durability::WRITTEN);
+
+    /*
+     * A logger of its own next to the global one initialize() sets up, with its own buffer,
+     * consumer thread, files and level, so a noisy subsystem cannot drop or delay the lines of
+     * another. Log to it with LOG_TO(logger, INFO) << ... Destroying it drains its buffer.
+     */
+    class Logger
+    {
+    public:
+        Logger(GuaranteedLogger gl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options = LoggerOptions());
+        Logger(NonGuaranteedLogger ngl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options = LoggerOptions());
+        Logger(ByteRingLogger brl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options = LoggerOptions());
+        Logger(PerThreadLogger ptl, std::string const &log_directory, std::string const &log_file_name, uint32_t log_file_roll_size_mb, LoggerOptions const &options = LoggerOptions());
+        ~Logger();
+
+        // This logger's threshold, set_log_level and module levels only apply to the global one.
+        void set_level(LogLevel level)
+        {
+            m_level.store(level, std::memory_order_relaxed);
+        }
+
+        bool is_logged(LogLevel level) const
+        {
+            return level >= m_level.load(std::memory_order_relaxed);
+        }
+
+        LoggerStats stats();
+        void flush(Durability durability = Durability::WRITTEN);
+
+        Logger(Logger const &) = delete;
+        Logger &operator=(Logger const &) = delete;
+
+    private:
+        friend struct LLog;
+
+        std::unique_ptr<LLogger> m_logger;
+        std::atomic<LogLevel> m_level;
+    };
+
+    struct DecodeFilter
+    {
+        LogLevel min_level = LogLevel::TRACE;
+        // Timestamps in microseconds since epoch, inclusive.
+        uint64_t since = 0;
+        uint64_t until = UINT64_MAX;
+        // Substring of the source file name, empty matches all.
+        std::string file;
+        // Substring of the formatted line, empty matches all.
+        std::string contains;
+    };
+
+    /*
+     * Turn a binary log written with LogFormat::BINARY back into TEXT, JSON or LOGFMT.
+     * Concatenated files are accepted. Returns false if the input is truncated or corrupt.
+     */
+    bool decode_binary_log(std::istream &is, std::ostream &os, DecodeFilter const &filter = DecodeFilter(), LogFormat format = LogFormat::TEXT);
+
+    // Turn a file written with Compression::ROLLED or STREAMING back into its contents. Returns false if it is not one or it is corrupt.
+    bool decompress_log(std::istream &is, std::ostream &os);
+
+    // Turn a flight recorder file or its crash dump into the text format, oldest record first. Returns false if it is not one.
+    bool recover_flight_recorder(std::istream &is, std::ostream &os);
 
 } //namespace llog
 
@@ -115,8 +1078,51 @@ namespace llog
 __FILE__：在源文件中插入当前源文件名；
 __LINE__：在源代码中插入当前源代码行号；
 */
-#define LLOG(LEVEL) llog::LLog() == llog::LLogLine(LEVEL, __FILE__, __func__, __LINE__)
+#define LLOG_SITE(LEVEL) [](char const *function, llog::LogLevel level) { static uint32_t const site_id = llog::register_site(__FILE__, function, __LINE__, level); return site_id; }(__func__, LEVEL)
+
+#define LLOG_SITE_V(LEVEL, SIGNATURE) [](char const *function, llog::LogLevel level, char const *signature) { static uint32_t const site_id = llog::register_site(__FILE__, function, __LINE__, level, signature); return site_id; }(__func__, LEVEL, SIGNATURE)
+
+#define LLOG(LEVEL) llog::LLog() == llog::LLogLine(LEVEL, LLOG_SITE(LEVEL))
+
+/*
+ * Statements below this level compile to nothing, 0 TRACE, 1 DEBUG, 2 INFO, 3 WARN, 4 CRIT.
+ * Build with e.g. -DLLOG_MIN_LEVEL=2 to strip TRACE and DEBUG.
+ */
+#ifndef LLOG_MIN_LEVEL
+#define LLOG_MIN_LEVEL 0
+#endif
+
+// Compile-time check, then the call site's cached runtime decision.
+#define LLOG_ENABLED(LEVEL) llog::compiled_in<LLOG_MIN_LEVEL>(static_cast<int>(LEVEL)) && [](llog::LogLevel level) { static std::atomic<uint32_t> state[llog::log_level_count] = {}; return llog::site_enabled(state, __FILE__, level); }(LEVEL)
+
+#define LLOG_IF(LEVEL) LLOG_ENABLED(LEVEL) && LLOG(LEVEL)
+
+// LLOG_V(llog::LogLevel::INFO, "order ", id, llog::kv("px", price)), same output as LOG_INFO << ..., encoded in one pass.
+#define LLOG_V(LEVEL, ...) LLOG_ENABLED(LEVEL) && \
+    llog::DirectLine{llog::LLog(), LEVEL, LLOG_SITE_V(LEVEL, decltype(llog::detail::signature_of(__VA_ARGS__))::value)}.write(__VA_ARGS__)
+
+// GATE is a RateLimiter member taking ARG of TYPE. A skipped statement constructs no logline.
+#define LLOG_GATED(LEVEL, GATE, TYPE, ARG) LLOG_ENABLED(LEVEL) && [](TYPE arg) { static thread_local llog::RateLimiter limiter; return limiter.GATE(arg); }(ARG) && \
+    llog::LLog() == llog::LLogLine(LEVEL, LLOG_SITE(LEVEL)) << llog::Suppressed{llog::take_suppressed()}
+
+#define LOG_TRACE LLOG_IF(llog::LogLevel::TRACE)
+#define LOG_DEBUG LLOG_IF(llog::LogLevel::DEBUG)
+#define LOG_INFO LLOG_IF(llog::LogLevel::INFO)
+#define LOG_WARN LLOG_IF(llog::LogLevel::WARN)
+#define LOG_CRIT LLOG_IF(llog::LogLevel::CRIT)
+
+// LOG_EVERY_N(WARN, 1000) << ...; counted per call site and thread.
+#define LOG_EVERY_N(LEVEL, N) LLOG_GATED(llog::LogLevel::LEVEL, every_n, uint64_t, N)
+#define LOG_FIRST_N(LEVEL, N) LLOG_GATED(llog::LogLevel::LEVEL, first_n, uint64_t, N)
+#define LOG_EVERY_MS(LEVEL, MS) LLOG_GATED(llog::LogLevel::LEVEL, every_ms, uint64_t, MS)
+#define LOG_SAMPLED(LEVEL, P) LLOG_GATED(llog::LogLevel::LEVEL, sampled, double, P)
+
+// LLOG_TO(logger, llog::LogLevel::INFO) << ..., to a Logger instead of the global logger, gated by its level only.
+#define LLOG_TO(LOGGER, LEVEL) llog::compiled_in<LLOG_MIN_LEVEL>(static_cast<int>(LEVEL)) && (LOGGER).is_logged(LEVEL) && \
+    llog::LLog(LOGGER) == llog::LLogLine(LEVEL, LLOG_SITE(LEVEL))
+
+#define LLOG_V_TO(LOGGER, LEVEL, ...) llog::compiled_in<LLOG_MIN_LEVEL>(static_cast<int>(LEVEL)) && (LOGGER).is_logged(LEVEL) && \
+    llog::DirectLine{llog::LLog(LOGGER), LEVEL, LLOG_SITE_V(LEVEL, decltype(llog::detail::signature_of(__VA_ARGS__))::value)}.write(__VA_ARGS__)
 
-#define LOG_INFO llog::is_logged(llog::LogLevel::INFO) && LLOG(llog::LogLevel::INFO)
-#define LOG_WARN llog::is_logged(llog::LogLevel::WARN) && LLOG(llog::LogLevel::WARN)
-#define LOG_CRIT llog::is_logged(llog::LogLevel::CRIT) && LLOG(llog::LogLevel::CRIT)
\ No newline at end of file
+// LOG_TO(logger, INFO) << ...
+#define LOG_TO(LOGGER, LEVEL) LLOG_TO(LOGGER, llog::LogLevel::LEVEL)
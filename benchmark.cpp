@@ -3,47 +3,303 @@
 #include <thread>
 #include <vector>
 #include <atomic>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
 #include "LLog.hpp"
 
-uint64_t timestamp_now()
-{
-    return std::chrono::high_resolution_clock::now().time_since_epoch() / std::chrono::microseconds(1);
-}
+/*
+ * Runs every combination of logger mode, producer thread count and payload, and reports
+ * per-call producer latency percentiles, producer throughput and the consumer's lines/sec,
+ * i.e. lines that reached the file divided by the time until the background thread drained.
+ *
+ * usage: benchmark [--dir DIR] [--iterations N] [--threads 1,2,4] [--modes a,b] [--payloads a,b]
+ *                  [--csv FILE] [--json FILE]
+ */
 
-void llog_benchmark()
+namespace
 {
-    int const iterations = 100000;
-    char const *const benchmark = "benchmark";
-    uint64_t begin = timestamp_now();
+    using Clock = std::chrono::steady_clock;
 
-    for (int i = 0; i < iterations; ++i)
+    uint64_t nanoseconds_since(Clock::time_point begin)
     {
-        LOG_INFO << "Logging" << benchmark << i << 0 << 'K' << -42.42;
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count();
     }
 
-    uint64_t end = timestamp_now();
-    long int avg_latency = (end - begin) * 1000 / iterations;
-    printf("\tAverage LLog Latency = %ld nanoseconds\n", avg_latency);
-}
+    struct Mode
+    {
+        char const *name;
+        void (*initialize)(std::string const &directory, std::string const &name);
+    };
 
-template <typename Function>
-void run_benchmark(Function &&f, int thread_count)
-{
-    printf("Thread count: %d\n", thread_count);
-    std::vector<std::thread> threads;
-    for (int i = 0; i < thread_count; ++i)
-        threads.emplace_back(f);
-    for (int i = 0; i < thread_count; ++i)
-        threads[i].join();
-}
+    Mode const modes[] = {
+        {"guaranteed", [](std::string const &d, std::string const &n) { llog::initialize(llog::GuaranteedLogger(), d, n, 1024); }},
+        {"nonguaranteed", [](std::string const &d, std::string const &n) { llog::initialize(llog::NonGuaranteedLogger(10), d, n, 1024); }},
+        {"perthread", [](std::string const &d, std::string const &n) { llog::initialize(llog::PerThreadLogger(1024), d, n, 1024); }},
+        {"bytering", [](std::string const &d, std::string const &n) { llog::initialize(llog::ByteRingLogger(10), d, n, 1024); }},
+        {"iouring", [](std::string const &d, std::string const &n) {
+             llog::LoggerOptions options;
+             options.io_backend = llog::IoBackend::IO_URING;
+             llog::initialize(llog::GuaranteedLogger(), d, n, 1024, options);
+         }},
+    };
+
+    std::string const string_64(64, 's');
+    std::string const string_1k(1024, 'l');
+
+    struct Payload
+    {
+        char const *name;
+        void (*log)(int i);
+    };
+
+    Payload const payloads[] = {
+        // Four integers, the cheapest encode.
+        {"ints", [](int i) { LOG_INFO << i << 42u << int64_t(-7) << uint64_t(i); }},
+        // The statement the original benchmark used.
+        {"mixed", [](int i) { char const *const benchmark = "benchmark"; LOG_INFO << "Logging" << benchmark << i << 0 << 'K' << -42.42; }},
+        // The same statement through the single-pass variadic encoder.
+        {"mixedv", [](int i) { char const *const benchmark = "benchmark"; LLOG_V(llog::LogLevel::INFO, "Logging", benchmark, i, 0, 'K', -42.42); }},
+        {"str64", [](int i) { LOG_INFO << "payload " << string_64 << ' ' << i; }},
+        // Longer than the 256 byte logline, spills to the heap.
+        {"str1k", [](int i) { LOG_INFO << "payload " << string_1k << ' ' << i; }},
+    };
+
+    struct Options
+    {
+        std::string directory = "/tmp/";
+        int iterations = 100000;
+        std::vector<int> threads{1, 2, 4};
+        std::vector<std::string> modes;
+        std::vector<std::string> payloads;
+        std::string csv;
+        std::string json;
+    };
+
+    struct Result
+    {
+        std::string mode;
+        std::string payload;
+        int threads;
+        uint64_t lines;
+        uint64_t lines_written;
+        uint64_t p50_ns;
+        uint64_t p99_ns;
+        uint64_t p999_ns;
+        uint64_t max_ns;
+        double producer_lines_per_sec;
+        double consumer_lines_per_sec;
+    };
+
+    std::vector<std::string> split(std::string const &s)
+    {
+        std::vector<std::string> parts;
+        std::stringstream ss(s);
+        std::string part;
+        while (std::getline(ss, part, ','))
+        {
+            if (!part.empty())
+                parts.push_back(part);
+        }
+        return parts;
+    }
+
+    bool selected(std::vector<std::string> const &filter, char const *name)
+    {
+        return filter.empty() || std::find(filter.begin(), filter.end(), name) != filter.end();
+    }
+
+    // Counts and removes the files a run wrote, name.1.txt, name.2.txt, ...
+    uint64_t count_and_remove_lines(std::string const &directory, std::string const &name)
+    {
+        uint64_t lines = 0;
+        for (int n = 1;; ++n)
+        {
+            std::string path = directory + name + "." + std::to_string(n) + ".txt";
+            std::ifstream file(path, std::ios::binary);
+            if (!file)
+                break;
+            char block[1 << 16];
+            while (file.read(block, sizeof(block)) || file.gcount() > 0)
+                lines += std::count(block, block + file.gcount(), '\n');
+            file.close();
+            std::remove(path.c_str());
+        }
+        return lines;
+    }
+
+    uint64_t percentile(std::vector<uint32_t> const &sorted, double p)
+    {
+        size_t index = static_cast<size_t>(p * (sorted.size() - 1));
+        return sorted[index];
+    }
+
+    Result run(Options const &options, Mode const &mode, Payload const &payload, int thread_count)
+    {
+        std::string const name = std::string("llog_bench_") + mode.name + "_" + payload.name + "_" + std::to_string(thread_count);
+        mode.initialize(options.directory, name);
+
+        std::vector<std::vector<uint32_t>> latencies(thread_count);
+        std::atomic<int> ready(0);
+        std::atomic<bool> go(false);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < thread_count; ++t)
+        {
+            threads.emplace_back([&, t] {
+                std::vector<uint32_t> &samples = latencies[t];
+                samples.reserve(options.iterations);
+                // Warm the thread's staging state before measuring.
+                payload.log(-1);
+                ready.fetch_add(1);
+                while (!go.load())
+                    std::this_thread::yield();
+                for (int i = 0; i < options.iterations; ++i)
+                {
+                    Clock::time_point begin = Clock::now();
+                    payload.log(i);
+                    samples.push_back(static_cast<uint32_t>(std::min<uint64_t>(nanoseconds_since(begin), UINT32_MAX)));
+                }
+            });
+        }
+        while (ready.load() != thread_count)
+            std::this_thread::yield();
+
+        Clock::time_point begin = Clock::now();
+        go.store(true);
+        for (auto &thread : threads)
+            thread.join();
+        uint64_t const produce_ns = nanoseconds_since(begin);
+
+        // Replacing the logger joins the old one after it drained its buffer.
+        llog::initialize(llog::NonGuaranteedLogger(1), options.directory, name + "_idle", 1);
+        uint64_t const drain_ns = nanoseconds_since(begin);
+        count_and_remove_lines(options.directory, name + "_idle");
+
+        std::vector<uint32_t> all;
+        all.reserve(static_cast<size_t>(thread_count) * options.iterations);
+        for (auto const &samples : latencies)
+            all.insert(all.end(), samples.begin(), samples.end());
+        std::sort(all.begin(), all.end());
+
+        Result result;
+        result.mode = mode.name;
+        result.payload = payload.name;
+        result.threads = thread_count;
+        // Including each thread's warm-up line.
+        result.lines = all.size() + thread_count;
+        result.lines_written = count_and_remove_lines(options.directory, name);
+        result.p50_ns = percentile(all, 0.5);
+        result.p99_ns = percentile(all, 0.99);
+        result.p999_ns = percentile(all, 0.999);
+        result.max_ns = all.back();
+        result.producer_lines_per_sec = all.size() * 1e9 / produce_ns;
+        result.consumer_lines_per_sec = result.lines_written * 1e9 / drain_ns;
+        return result;
+    }
 
-int main()
+    void write_csv(std::ostream &os, std::vector<Result> const &results)
+    {
+        os << "mode,payload,threads,lines,lines_written,p50_ns,p99_ns,p999_ns,max_ns,producer_lines_per_sec,consumer_lines_per_sec\n";
+        for (auto const &r : results)
+        {
+            os << r.mode << ',' << r.payload << ',' << r.threads << ',' << r.lines << ',' << r.lines_written << ','
+               << r.p50_ns << ',' << r.p99_ns << ',' << r.p999_ns << ',' << r.max_ns << ','
+               << static_cast<uint64_t>(r.producer_lines_per_sec) << ',' << static_cast<uint64_t>(r.consumer_lines_per_sec) << '\n';
+        }
+    }
+
+    void write_json(std::ostream &os, std::vector<Result> const &results)
+    {
+        os << "[\n";
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            Result const &r = results[i];
+            os << "  {\"mode\": \"" << r.mode << "\", \"payload\": \"" << r.payload << "\", \"threads\": " << r.threads
+               << ", \"lines\": " << r.lines << ", \"lines_written\": " << r.lines_written
+               << ", \"p50_ns\": " << r.p50_ns << ", \"p99_ns\": " << r.p99_ns << ", \"p999_ns\": " << r.p999_ns << ", \"max_ns\": " << r.max_ns
+               << ", \"producer_lines_per_sec\": " << static_cast<uint64_t>(r.producer_lines_per_sec)
+               << ", \"consumer_lines_per_sec\": " << static_cast<uint64_t>(r.consumer_lines_per_sec) << "}"
+               << (i + 1 < results.size() ? ",\n" : "\n");
+        }
+        os << "]\n";
+    }
+
+    int usage()
+    {
+        fprintf(stderr, "usage: benchmark [--dir DIR] [--iterations N] [--threads 1,2,4] [--modes a,b] [--payloads a,b] [--csv FILE] [--json FILE]\n");
+        return 2;
+    }
+} // namespace
+
+int main(int argc, char **argv)
 {
-    llog::initialize(llog::NonGuaranteedLogger(10), "/home/quenkar/code/Log/LLog/", "llog", 1);
-    for (auto threads : {1, 2, 3, 4, 5})
-        run_benchmark(llog_benchmark, threads);
+    Options options;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+            return usage();
+        std::string value = argv[++i];
+        if (arg == "--dir")
+            options.directory = value.back() == '/' ? value : value + "/";
+        else if (arg == "--iterations")
+            options.iterations = std::max(1, atoi(value.c_str()));
+        else if (arg == "--threads")
+        {
+            options.threads.clear();
+            for (auto const &t : split(value))
+                options.threads.push_back(std::max(1, atoi(t.c_str())));
+        }
+        else if (arg == "--modes")
+            options.modes = split(value);
+        else if (arg == "--payloads")
+            options.payloads = split(value);
+        else if (arg == "--csv")
+            options.csv = value;
+        else if (arg == "--json")
+            options.json = value;
+        else
+            return usage();
+    }
+
+    std::vector<Result> results;
+    printf("%-14s %-7s %7s %9s %9s %9s %9s %11s %13s %13s\n", "mode", "payload", "threads", "p50(ns)", "p99(ns)", "p99.9(ns)", "max(ns)",
+           "written", "produce/s", "consume/s");
+    for (auto const &mode : modes)
+    {
+        if (!selected(options.modes, mode.name))
+            continue;
+        for (auto const &payload : payloads)
+        {
+            if (!selected(options.payloads, payload.name))
+                continue;
+            for (int threads : options.threads)
+            {
+                Result r = run(options, mode, payload, threads);
+                printf("%-14s %-7s %7d %9llu %9llu %9llu %9llu %11llu %13.0f %13.0f\n", r.mode.c_str(), r.payload.c_str(), r.threads,
+                       (unsigned long long)r.p50_ns, (unsigned long long)r.p99_ns, (unsigned long long)r.p999_ns, (unsigned long long)r.max_ns,
+                       (unsigned long long)r.lines_written, r.producer_lines_per_sec, r.consumer_lines_per_sec);
+                fflush(stdout);
+                results.push_back(r);
+            }
+        }
+    }
+
+    if (!options.csv.empty())
+    {
+        std::ofstream csv(options.csv);
+        write_csv(csv, results);
+    }
+    if (!options.json.empty())
+    {
+        std::ofstream json(options.json);
+        write_json(json, results);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,133 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "LLog.hpp"
+
+/*
+ * Decode binary LLog files (LogFormat::BINARY) into the text, JSON Lines or logfmt format.
+ * Compressed files (.lz) are decompressed first, compressed text files are printed as they are.
+ * Reads stdin when no file is given.
+ */
+void usage()
+{
+    fprintf(stderr,
+            "usage: llog-decode [options] [file...]\n"
+            "  --level LEVEL            only lines at or above TRACE, DEBUG, INFO, WARN or CRIT\n"
+            "  --since US               only lines at or after this timestamp (microseconds since epoch)\n"
+            "  --until US               only lines at or before this timestamp (microseconds since epoch)\n"
+            "  --file SUBSTR            only lines logged from a source file containing SUBSTR\n"
+            "  --grep SUBSTR            only lines containing SUBSTR\n"
+            "  --format FORMAT          text (default), json or logfmt\n");
+}
+
+bool parse_level(char const *s, llog::LogLevel &level)
+{
+    if (strcmp(s, "TRACE") == 0)
+        level = llog::LogLevel::TRACE;
+    else if (strcmp(s, "DEBUG") == 0)
+        level = llog::LogLevel::DEBUG;
+    else if (strcmp(s, "INFO") == 0)
+        level = llog::LogLevel::INFO;
+    else if (strcmp(s, "WARN") == 0)
+        level = llog::LogLevel::WARN;
+    else if (strcmp(s, "CRIT") == 0)
+        level = llog::LogLevel::CRIT;
+    else
+        return false;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    llog::DecodeFilter filter;
+    llog::LogFormat format = llog::LogFormat::TEXT;
+    std::vector<char const *> files;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string const arg = argv[i];
+        bool const has_value = i + 1 < argc;
+        if (arg == "--level" && has_value)
+        {
+            if (!parse_level(argv[++i], filter.min_level))
+            {
+                usage();
+                return 2;
+            }
+        }
+        else if (arg == "--since" && has_value)
+            filter.since = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--until" && has_value)
+            filter.until = strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--file" && has_value)
+            filter.file = argv[++i];
+        else if (arg == "--grep" && has_value)
+            filter.contains = argv[++i];
+        else if (arg == "--format" && has_value)
+        {
+            std::string const name = argv[++i];
+            if (name == "text")
+                format = llog::LogFormat::TEXT;
+            else if (name == "json")
+                format = llog::LogFormat::JSON;
+            else if (name == "logfmt")
+                format = llog::LogFormat::LOGFMT;
+            else
+            {
+                usage();
+                return 2;
+            }
+        }
+        else if (arg.compare(0, 2, "--") == 0)
+        {
+            usage();
+            return 2;
+        }
+        else
+            files.push_back(argv[i]);
+    }
+
+    std::ios::sync_with_stdio(false);
+
+    if (files.empty())
+        return llog::decode_binary_log(std::cin, std::cout, filter, format) ? 0 : 1;
+
+    int status = 0;
+    for (char const *file : files)
+    {
+        std::ifstream is(file, std::ifstream::in | std::ifstream::binary);
+        if (!is)
+        {
+            fprintf(stderr, "llog-decode: cannot open %s\n", file);
+            status = 1;
+            continue;
+        }
+        std::stringstream decompressed;
+        bool decoded;
+        if (llog::decompress_log(is, decompressed))
+        {
+            if (decompressed.peek() == 'L')
+                decoded = llog::decode_binary_log(decompressed, std::cout, filter, format);
+            else
+                decoded = static_cast<bool>(std::cout << decompressed.str());
+        }
+        else
+        {
+            is.clear();
+            is.seekg(0);
+            decoded = llog::decode_binary_log(is, std::cout, filter, format);
+        }
+        if (!decoded)
+        {
+            fprintf(stderr, "llog-decode: %s is truncated or corrupt\n", file);
+            status = 1;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,38 @@
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+#include "LLog.hpp"
+
+/*
+ * Decode a flight recorder file (LoggerOptions::flight_recorder_path) or the copy a fatal
+ * signal dumped (LoggerOptions::flight_recorder_dump_path) into the text format.
+ */
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: llog-recover file...\n");
+        return 2;
+    }
+
+    std::ios::sync_with_stdio(false);
+
+    int status = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::ifstream is(argv[i], std::ifstream::in | std::ifstream::binary);
+        if (!is)
+        {
+            fprintf(stderr, "llog-recover: cannot open %s\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        if (!llog::recover_flight_recorder(is, std::cout))
+        {
+            fprintf(stderr, "llog-recover: %s is not a flight recorder file\n", argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
@@ -0,0 +1,654 @@
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "LLog.hpp"
+
+/*
+ * Round trips for the formats LLog writes, run by make test. The same lines go to a TEXT logger
+ * and to the logger under test, what comes back out of the other format has to match the text
+ * file line for line, timestamps aside. Exits non-zero when a check fails.
+ */
+
+std::string read_file(std::string const &path)
+{
+    std::ifstream is(path, std::ifstream::in | std::ifstream::binary);
+    std::stringstream contents;
+    contents << is.rdbuf();
+    return contents.str();
+}
+
+// The lines of a TEXT log without the leading [timestamp], which differs between loggers.
+std::vector<std::string> strip_timestamps(std::string const &text)
+{
+    std::vector<std::string> lines;
+    std::istringstream is(text);
+    std::string line;
+    while (std::getline(is, line))
+    {
+        size_t const end = line.find(']');
+        lines.push_back(end == std::string::npos ? line : line.substr(end + 1));
+    }
+    return lines;
+}
+
+bool check(char const *name, std::vector<std::string> const &expected, std::vector<std::string> const &actual)
+{
+    if (expected.empty())
+    {
+        fprintf(stderr, "FAIL %s: nothing was logged\n", name);
+        return false;
+    }
+    for (size_t i = 0; i < expected.size() || i < actual.size(); ++i)
+    {
+        if (i >= expected.size() || i >= actual.size() || expected[i] != actual[i])
+        {
+            fprintf(stderr, "FAIL %s: line %zu of %zu/%zu differs\n  expected %s\n  actual   %s\n", name, i + 1, expected.size(), actual.size(),
+                    i < expected.size() ? expected[i].c_str() : "(none)", i < actual.size() ? actual[i].c_str() : "(none)");
+            return false;
+        }
+    }
+    printf("ok %s, %zu lines\n", name, expected.size());
+    return true;
+}
+
+// The message of each line, what follows "[time][LEVEL][thread][file:function:line]".
+std::vector<std::string> messages(std::string const &text)
+{
+    std::vector<std::string> lines;
+    std::istringstream is(text);
+    std::string line;
+    while (std::getline(is, line))
+    {
+        size_t end = 0;
+        for (int i = 0; i < 4 && end != std::string::npos; ++i)
+            end = line.find(']', end + (i != 0));
+        lines.push_back(end == std::string::npos ? line : line.substr(end + 1));
+    }
+    return lines;
+}
+
+/*
+ * Holds up the consumer inside its write of the CRIT line "gate" until open() is called, so the
+ * lines logged meanwhile stay in the buffer.
+ */
+class GateSink : public llog::Sink
+{
+public:
+    GateSink() : llog::Sink(llog::LogLevel::CRIT, llog::LogFormat::TEXT), m_entered(false), m_open(false) {}
+
+    bool write(char const *data, size_t length, llog::LogLevel) override
+    {
+        if (std::string(data, length).find("]gate\n") == std::string::npos)
+            return true;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_entered = true;
+        m_changed.notify_all();
+        m_changed.wait(lock, [this] { return m_open; });
+        return true;
+    }
+
+    void wait_entered()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [this] { return m_entered; });
+    }
+
+    void open()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_open = true;
+        m_changed.notify_all();
+    }
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    bool m_entered;
+    bool m_open;
+};
+
+struct Endpoint
+{
+    uint32_t address;
+    uint16_t port;
+};
+
+namespace llog
+{
+    template <>
+    struct LogTraits<Endpoint>
+    {
+        static size_t size(Endpoint const &)
+        {
+            return sizeof(uint32_t) + sizeof(uint16_t);
+        }
+
+        static void encode(Endpoint const &e, char *out)
+        {
+            memcpy(out, &e.address, sizeof(e.address));
+            memcpy(out + sizeof(e.address), &e.port, sizeof(e.port));
+        }
+
+        static void format(char const *in, size_t, TextWriter &out)
+        {
+            uint32_t address;
+            uint16_t port;
+            memcpy(&address, in, sizeof(address));
+            memcpy(&port, in + sizeof(address), sizeof(port));
+            for (int shift = 24; shift >= 0; shift -= 8)
+            {
+                out.append_unsigned((address >> shift) & 0xff);
+                out.append(shift != 0 ? '.' : ':');
+            }
+            out.append_unsigned(port);
+        }
+    };
+}
+
+// Incompressible text, so the LZ codec also sees long literal runs.
+std::string noise(uint32_t seed, size_t length)
+{
+    std::string text(length, ' ');
+    for (auto &c : text)
+    {
+        seed = seed * 1103515245u + 12345u;
+        c = static_cast<char>('!' + (seed >> 16) % 94);
+    }
+    return text;
+}
+
+// The flight recorder keeps LogTraits types as hex dumps, so it is not given any.
+void log_lines(llog::Logger &logger, bool user_types)
+{
+    logger.set_level(llog::LogLevel::TRACE);
+    for (int i = 0; i < 2000; ++i)
+    {
+        LOG_TO(logger, INFO) << "line " << i << ' ' << 2.5 * i << " str " << std::string(i % 7, 'x') << llog::kv("id", i);
+        LLOG_V_TO(logger, llog::LogLevel::DEBUG, "variadic ", i, ' ', -1.25, ' ', static_cast<uint64_t>(i) * 1000003, llog::kv("px", i * 3));
+        if (i % 10 == 0)
+            LOG_TO(logger, WARN) << "warn " << i << " " << static_cast<int64_t>(-i);
+        if (i % 100 == 0)
+            LOG_TO(logger, CRIT) << "crit " << i;
+        if (i % 50 == 0)
+            LOG_TO(logger, INFO) << "noise " << noise(static_cast<uint32_t>(i), 300);
+        if (user_types)
+            LOG_TO(logger, INFO) << "peer " << Endpoint{0x0a000001u + static_cast<uint32_t>(i), static_cast<uint16_t>(8000 + i)};
+    }
+}
+
+/*
+ * A ring of 4096 slots is filled while the consumer is held up, then overflows by 100 lines.
+ * SPILL has an overflow segment as large again before it drops. What each policy keeps and the
+ * count in the drop report and stats() are exact.
+ */
+bool check_overflow_policies(std::string const &directory)
+{
+    struct Case
+    {
+        char const *name;
+        llog::OverflowPolicy policy;
+        int logged;
+        int first_kept;
+        int last_kept;
+    };
+    int const slots = 4096;
+    Case const cases[] = {
+        {"DROP_OLDEST", llog::OverflowPolicy::DROP_OLDEST, slots + 100, 100, slots + 100},
+        {"DROP_NEWEST", llog::OverflowPolicy::DROP_NEWEST, slots + 100, 0, slots},
+        {"BLOCK", llog::OverflowPolicy::BLOCK, slots + 100, 0, slots},
+        {"SPILL", llog::OverflowPolicy::SPILL, 2 * slots + 100, 0, 2 * slots},
+    };
+
+    bool ok = true;
+    for (auto const &c : cases)
+    {
+        std::string const name = std::string("overflow ") + c.name;
+        std::shared_ptr<GateSink> gate(new GateSink());
+        llog::LoggerOptions options;
+        options.sinks.push_back(gate);
+        uint64_t dropped;
+        {
+            llog::Logger logger(llog::NonGuaranteedLogger(1, c.policy, 100), directory, c.name, 100, options);
+            LOG_TO(logger, CRIT) << "gate";
+            gate->wait_entered();
+            for (int i = 0; i < c.logged; ++i)
+                LOG_TO(logger, INFO) << "line " << i;
+            dropped = logger.stats().dropped;
+            gate->open();
+        }
+
+        std::vector<std::string> expected(1, "gate");
+        for (int i = c.first_kept; i < c.last_kept; ++i)
+            expected.push_back("line " + std::to_string(i));
+        expected.push_back("100 records dropped between ");
+        std::vector<std::string> actual = messages(read_file(directory + c.name + ".1.txt"));
+        if (!actual.empty())
+            actual.back() = actual.back().substr(0, expected.back().size());
+        ok &= check(name.c_str(), expected, actual);
+        if (dropped != 100)
+        {
+            fprintf(stderr, "FAIL %s: stats() counted %llu drops\n", name.c_str(), static_cast<unsigned long long>(dropped));
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+/*
+ * Lines of 0 to 20 KB and some of 700 KB go round a 1 MB byte ring some 20 times, so records are
+ * padded at the end of a lap and skip to the start. Lines larger than the ring are dropped.
+ */
+bool check_byte_ring(std::string const &directory)
+{
+    std::vector<std::string> expected;
+    uint64_t dropped;
+    {
+        llog::Logger logger(llog::ByteRingLogger(1), directory, "bytering", 100);
+        for (int i = 0; i < 1000; ++i)
+        {
+            size_t const length = i % 100 == 99 ? 700 * 1024 : (i * 7919) % 20000;
+            std::string const text(length, static_cast<char>('a' + i % 26));
+            LLOG_V_TO(logger, llog::LogLevel::INFO, "v ", i, ' ', text);
+            LOG_TO(logger, INFO) << "s " << i << ' ' << text;
+            expected.push_back("v " + std::to_string(i) + ' ' + text);
+            expected.push_back("s " + std::to_string(i) + ' ' + text);
+        }
+        logger.flush();
+        // Too big whichever way they are encoded.
+        std::string const oversize(2 * 1024 * 1024, 'z');
+        LLOG_V_TO(logger, llog::LogLevel::INFO, oversize);
+        LOG_TO(logger, INFO) << oversize;
+        dropped = logger.stats().dropped;
+    }
+
+    // The drops may be reported together or one by one.
+    std::vector<std::string> actual = messages(read_file(directory + "bytering.1.txt"));
+    uint64_t reported = 0;
+    while (!actual.empty() && actual.back().find(" records dropped between ") != std::string::npos)
+    {
+        reported += strtoull(actual.back().c_str(), nullptr, 10);
+        actual.pop_back();
+    }
+    bool ok = check("byte ring", expected, actual);
+    if (dropped != 2 || reported != 2)
+    {
+        fprintf(stderr, "FAIL byte ring: %llu drops counted, %llu reported\n", static_cast<unsigned long long>(dropped),
+                static_cast<unsigned long long>(reported));
+        ok = false;
+    }
+    return ok;
+}
+
+/*
+ * Four threads log into their own rings while the consumer is held up, so it merges full rings.
+ * The file has to be in timestamp order with each thread's lines complete and in its own order,
+ * and the rings of the exited threads have to be released once drained.
+ */
+bool check_per_thread_rings(std::string const &directory)
+{
+    int const threads = 4;
+    int const lines = 2000;
+    std::shared_ptr<GateSink> gate(new GateSink());
+    llog::LoggerOptions options;
+    options.sinks.push_back(gate);
+    size_t segments = 0;
+    {
+        llog::Logger logger(llog::PerThreadLogger(1024), directory, "perthread", 100, options);
+        LOG_TO(logger, CRIT) << "gate";
+        gate->wait_entered();
+        std::vector<std::thread> producers;
+        for (int t = 0; t < threads; ++t)
+        {
+            producers.emplace_back([&logger, t] {
+                for (int i = 0; i < lines; ++i)
+                    LOG_TO(logger, INFO) << "thread " << t << " line " << i;
+            });
+        }
+        for (auto &producer : producers)
+            producer.join();
+        gate->open();
+        logger.flush();
+        // Only the ring of this thread is left once the consumer passed over the drained ones.
+        for (int i = 0; i < 1000 && (segments = logger.stats().segments) != 1; ++i)
+            usleep(1000);
+    }
+
+    std::string const text = read_file(directory + "perthread.1.txt");
+    std::vector<std::string> expected;
+    std::vector<std::vector<std::string>> by_thread(threads);
+    for (int t = 0; t < threads; ++t)
+    {
+        for (int i = 0; i < lines; ++i)
+            expected.push_back("thread " + std::to_string(t) + " line " + std::to_string(i));
+    }
+    std::istringstream is(text);
+    std::string line;
+    std::string previous;
+    bool ordered = true;
+    for (auto const &message : messages(text))
+    {
+        std::getline(is, line);
+        std::string const timestamp = line.substr(0, line.find(']'));
+        ordered &= previous <= timestamp;
+        previous = timestamp;
+        if (message.compare(0, 7, "thread ") != 0)
+            continue;
+        int const t = atoi(message.c_str() + 7);
+        if (t >= 0 && t < threads)
+            by_thread[t].push_back(message);
+    }
+    std::vector<std::string> actual;
+    for (auto const &lines_of_thread : by_thread)
+        actual.insert(actual.end(), lines_of_thread.begin(), lines_of_thread.end());
+
+    bool ok = check("per thread rings", expected, actual);
+    if (!ordered)
+    {
+        fprintf(stderr, "FAIL per thread rings: lines are not in timestamp order\n");
+        ok = false;
+    }
+    if (segments != 1)
+    {
+        fprintf(stderr, "FAIL per thread rings: %zu rings left after the producers exited\n", segments);
+        ok = false;
+    }
+    return ok;
+}
+
+// One call site, each thread counts its own statements.
+void every_tenth(char const *name, int i)
+{
+    LOG_EVERY_N(INFO, 10) << name << ' ' << i;
+}
+
+/*
+ * The rate-limited statements go to the global logger. Each line that gets through carries the
+ * number of statements its call site skipped since the last one, so for statements numbered by
+ * i the prefix is the gap to the previous line, whether the gate counts, samples or times.
+ */
+bool check_rate_limits(std::string const &directory)
+{
+    llog::initialize(llog::GuaranteedLogger(), directory, "global", 100);
+    for (int i = 0; i < 100; ++i)
+    {
+        every_tenth("every", i);
+        LOG_FIRST_N(INFO, 3) << "first " << i;
+        LOG_SAMPLED(INFO, 0.25) << "sampled " << i;
+    }
+    std::thread other([] {
+        for (int i = 0; i < 100; ++i)
+            every_tenth("other", i);
+    });
+    other.join();
+    for (int i = 0; i < 200; ++i)
+    {
+        LOG_EVERY_MS(INFO, 20) << "ms " << i;
+        usleep(1000);
+    }
+    llog::flush();
+
+    char const *const names[] = {"every", "other", "first", "sampled", "ms"};
+    std::vector<std::string> actual[5];
+    std::vector<std::string> expected[5];
+    int previous[5] = {-1, -1, -1, -1, -1};
+    for (auto const &message : messages(read_file(directory + "global.1.txt")))
+    {
+        size_t const start = message.compare(0, 1, "[") == 0 ? message.find("] ") + 2 : 0;
+        size_t const space = message.find(' ', start);
+        for (size_t n = 0; n < 5 && space != std::string::npos; ++n)
+        {
+            if (message.compare(start, space - start, names[n]) != 0)
+                continue;
+            int const i = atoi(message.c_str() + space + 1);
+            int const skipped = i - previous[n] - 1;
+            previous[n] = i;
+            actual[n].push_back(message);
+            expected[n].push_back((skipped != 0 ? "[" + std::to_string(skipped) + " suppressed] " : "") + names[n] + ' ' + std::to_string(i));
+        }
+    }
+
+    bool ok = true;
+    for (size_t n = 0; n < 5; ++n)
+        ok &= check((std::string("rate limit ") + names[n]).c_str(), expected[n], actual[n]);
+    // What the counting gates let through, the prefixes are covered above.
+    size_t const passed[] = {10, 10, 3};
+    int const last[] = {90, 90, 2};
+    for (size_t n = 0; n < 3; ++n)
+    {
+        if (actual[n].size() != passed[n] || previous[n] != last[n])
+        {
+            fprintf(stderr, "FAIL rate limit %s: %zu lines up to %d\n", names[n], actual[n].size(), previous[n]);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+// The logger links against this one instead of the C library's, so the test can count its syncs.
+std::atomic<int> fdatasyncs{0};
+
+extern "C" int fdatasync(int fd)
+{
+    ++fdatasyncs;
+    return static_cast<int>(syscall(SYS_fdatasync, fd));
+}
+
+/*
+ * Blocks are only written on demand here. flush() has to put every line in the file and
+ * flush(SYNCED) has to add one fdatasync. SYNCED lines logged by eight threads while the
+ * consumer is held up have to share a single fdatasync, and each must be in the file by the
+ * time its statement returns.
+ */
+bool check_durability(std::string const &directory)
+{
+    llog::LoggerOptions options;
+    options.flush_interval_ms = 60000;
+    options.group_commit_us = 1000000;
+    options.durability[static_cast<size_t>(llog::LogLevel::WARN)] = llog::Durability::SYNCED;
+    std::shared_ptr<GateSink> gate(new GateSink());
+    options.sinks.push_back(gate);
+    std::string const path = directory + "durable.1.txt";
+    bool ok = true;
+
+    llog::Logger logger(llog::GuaranteedLogger(), directory, "durable", 100, options);
+    for (int i = 0; i < 100; ++i)
+        LOG_TO(logger, INFO) << "line " << i;
+    int syncs = fdatasyncs;
+    logger.flush();
+    size_t lines = messages(read_file(path)).size();
+    if (lines != 100 || fdatasyncs != syncs)
+    {
+        fprintf(stderr, "FAIL flush: %zu lines in the file, %d fdatasyncs\n", lines, fdatasyncs - syncs);
+        ok = false;
+    }
+
+    for (int i = 100; i < 200; ++i)
+        LOG_TO(logger, INFO) << "line " << i;
+    syncs = fdatasyncs;
+    logger.flush(llog::Durability::SYNCED);
+    lines = messages(read_file(path)).size();
+    if (lines != 200 || fdatasyncs != syncs + 1)
+    {
+        fprintf(stderr, "FAIL flush(SYNCED): %zu lines in the file, %d fdatasyncs\n", lines, fdatasyncs - syncs);
+        ok = false;
+    }
+
+    LOG_TO(logger, CRIT) << "gate";
+    gate->wait_entered();
+    uint64_t const produced = logger.stats().produced;
+    syncs = fdatasyncs;
+    int const threads = 8;
+    std::atomic<int> found{0};
+    std::vector<std::thread> writers;
+    for (int t = 0; t < threads; ++t)
+    {
+        writers.emplace_back([&, t] {
+            LOG_TO(logger, WARN) << "synced " << t;
+            std::vector<std::string> const written = messages(read_file(path));
+            if (std::find(written.begin(), written.end(), "synced " + std::to_string(t)) != written.end())
+                ++found;
+        });
+    }
+    // Every line is in the buffer and its thread waiting, the consumer writes them in one go.
+    while (logger.stats().produced != produced + threads)
+        usleep(1000);
+    usleep(50000);
+    gate->open();
+    for (auto &writer : writers)
+        writer.join();
+    if (found != threads || fdatasyncs != syncs + 1)
+    {
+        fprintf(stderr, "FAIL group commit: %d of %d lines in the file on return, %d fdatasyncs\n", found.load(), threads, fdatasyncs - syncs);
+        ok = false;
+    }
+    if (ok)
+        printf("ok flush and group commit\n");
+    return ok;
+}
+
+void remove_directory(std::string const &directory)
+{
+    if (DIR *dir = opendir(directory.c_str()))
+    {
+        while (dirent *entry = readdir(dir))
+        {
+            std::string const name = entry->d_name;
+            if (name != "." && name != "..")
+                unlink((directory + name).c_str());
+        }
+        closedir(dir);
+    }
+    rmdir(directory.c_str());
+}
+
+int main()
+{
+    char directory_template[] = "/tmp/llog-test-XXXXXX";
+    if (mkdtemp(directory_template) == nullptr)
+    {
+        perror("llog-test: mkdtemp");
+        return 1;
+    }
+    std::string const directory = std::string(directory_template) + "/";
+
+    std::string recovered;
+    {
+        llog::Logger text(llog::GuaranteedLogger(), directory, "text", 100);
+
+        llog::LoggerOptions binary_options;
+        binary_options.format = llog::LogFormat::BINARY;
+        llog::Logger binary(llog::GuaranteedLogger(), directory, "binary", 100, binary_options);
+
+        llog::LoggerOptions recorder_options;
+        recorder_options.flight_recorder_path = directory + "recorder.fr";
+        llog::Logger recorder(llog::GuaranteedLogger(), directory, "recorder", 100, recorder_options);
+
+        llog::LoggerOptions streaming_options;
+        streaming_options.compression = llog::Compression::STREAMING;
+        llog::Logger streaming(llog::GuaranteedLogger(), directory, "streaming", 100, streaming_options);
+
+        // Rolls at 1 MB. Files still waiting at shutdown stay uncompressed, so the test waits for it below.
+        llog::LoggerOptions rolled_options;
+        rolled_options.compression = llog::Compression::ROLLED;
+        rolled_options.compression_cpu_percent = 100;
+        llog::Logger rolled(llog::GuaranteedLogger(), directory, "rolled", 1, rolled_options);
+
+        log_lines(text, true);
+        log_lines(binary, true);
+        log_lines(recorder, false);
+        log_lines(streaming, true);
+        for (int i = 0; i < 3; ++i)
+            log_lines(rolled, true);
+        // The uncompressed file is removed once its .lz is complete.
+        for (int i = 0; i < 1000 && access((directory + "rolled.1.txt").c_str(), F_OK) == 0; ++i)
+            usleep(10000);
+
+        // The recorder file goes away with its logger, read it while it is still mapped.
+        recorder.flush();
+        std::istringstream region(read_file(directory + "recorder.fr"));
+        std::ostringstream os;
+        if (!llog::recover_flight_recorder(region, os))
+            fprintf(stderr, "llog-test: recover_flight_recorder rejected the file\n");
+        recovered = os.str();
+    }
+
+    bool ok = true;
+    std::vector<std::string> const expected = strip_timestamps(read_file(directory + "text.1.txt"));
+
+    std::string const encoded = read_file(directory + "binary.1.bin");
+    {
+        std::istringstream is(encoded);
+        std::ostringstream os;
+        ok &= llog::decode_binary_log(is, os);
+        ok &= check("binary codec", expected, strip_timestamps(os.str()));
+    }
+
+    {
+        llog::DecodeFilter filter;
+        filter.min_level = llog::LogLevel::WARN;
+        filter.contains = "crit 1";
+        std::vector<std::string> filtered;
+        for (auto const &line : expected)
+        {
+            if (line.compare(0, 6, "[CRIT]") == 0 && line.find("crit 1") != std::string::npos)
+                filtered.push_back(line);
+        }
+        std::istringstream is(encoded);
+        std::ostringstream os;
+        ok &= llog::decode_binary_log(is, os, filter);
+        ok &= check("llog-decode filters", filtered, strip_timestamps(os.str()));
+    }
+
+    {
+        // A truncated file decodes what it can and reports it.
+        std::istringstream is(encoded.substr(0, encoded.size() - 3));
+        std::ostringstream os;
+        if (llog::decode_binary_log(is, os))
+        {
+            fprintf(stderr, "FAIL binary codec: truncated input was accepted\n");
+            ok = false;
+        }
+    }
+
+    {
+        std::istringstream is(read_file(directory + "streaming.1.txt.lz"));
+        std::ostringstream os;
+        ok &= llog::decompress_log(is, os);
+        ok &= check("LZ codec, streaming", expected, strip_timestamps(os.str()));
+    }
+
+    {
+        std::vector<std::string> expected_rolled;
+        for (int i = 0; i < 3; ++i)
+            expected_rolled.insert(expected_rolled.end(), expected.begin(), expected.end());
+        std::istringstream is(read_file(directory + "rolled.1.txt.lz"));
+        std::ostringstream os;
+        ok &= llog::decompress_log(is, os);
+        os << read_file(directory + "rolled.2.txt");
+        ok &= check("LZ codec, rolled", expected_rolled, strip_timestamps(os.str()));
+    }
+
+    ok &= check("llog-recover", strip_timestamps(read_file(directory + "recorder.1.txt")), strip_timestamps(recovered));
+    ok &= check_overflow_policies(directory);
+    ok &= check_byte_ring(directory);
+    ok &= check_per_thread_rings(directory);
+    ok &= check_rate_limits(directory);
+    ok &= check_durability(directory);
+
+    remove_directory(directory);
+    return ok ? 0 : 1;
+}